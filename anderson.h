@@ -0,0 +1,134 @@
+#pragma once
+
+//
+// Anderson's Array-Based Queue Lock
+//
+// Like the GTA lock every waiter spins on its own padded slot, but instead of
+// a fixed thread ID a contender gets its slot by taking a ticket, so threads
+// can come and go without being handed an ID.
+//
+// A slot holds 1 when the thread waiting on it has been granted the lock. The
+// owner clears its slot when it takes the lock and releases by setting the
+// next slot in line.
+//
+// The slot count only has to cover the number of threads contending at once
+// (the owner included), not every thread that might ever take the lock. If
+// more than that pile up two threads end up on the same slot and mutual
+// exclusion is gone, so size it for the worst case. It has to be a power of 2
+// so tickets wrap cleanly, anderson_slot_count() rounds up.
+//
+// The slots are the same gs_t as the GTA lock and are supplied by the caller
+// in the same way.
+//
+// A waiter's slot only says whether it's been granted, not how far it is from
+// the front, so BACKOFF_PROP gives it the same single pause as BACKOFF_PAUSE.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+#include "gta.h"
+
+typedef struct anderson_lock anderson_t;
+struct anderson_lock {
+    alignas(64) atomic_uint m_ticket;
+    // The owner's slot, only touched by the owner
+    alignas(64) unsigned m_owner;
+    // Slot count - 1
+    unsigned m_mask;
+    gs_t *slots;
+    size_t m_allocsz;
+};
+
+/**
+ * Round a number of concurrent contenders up to a usable slot count.
+ */
+static inline unsigned
+anderson_slot_count(unsigned const contenders)
+{
+    unsigned n = 1;
+    while (n < contenders) {
+        n *= 2;
+    }
+    return n;
+}
+
+static inline void
+anderson_acquire(anderson_t *const p_lock)
+{
+    unsigned const ticket = atomic_fetch_add_explicit(&p_lock->m_ticket, 1, memory_order_relaxed);
+    unsigned const idx = ticket & p_lock->m_mask;
+    atomic_uintptr_t *const slot = &p_lock->slots[idx].v;
+
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        if (atomic_load_explicit(slot, memory_order_acquire) != 0) {
+            break;
+        }
+#if defined(__arm__) || defined(__aarch64__)
+        wfe();
+#else
+        backoff_wait(&l_bo);
+#endif
+    }
+
+    // Ready for whoever gets this slot next time round. They can't be granted
+    // it until after our release, which orders this store first.
+    atomic_store_explicit(slot, 0, memory_order_relaxed);
+    p_lock->m_owner = idx;
+}
+
+static inline void
+anderson_release(anderson_t *const p_lock)
+{
+    unsigned const next = (p_lock->m_owner + 1) & p_lock->m_mask;
+    atomic_store_explicit(&p_lock->slots[next].v, 1, memory_order_release);
+#if defined(__arm__) || defined(__aarch64__)
+    sev();
+#endif
+}
+
+/**
+ * Take the lock if it's free and nobody is waiting.
+ *
+ * @return true if the lock was taken
+ */
+static inline bool
+anderson_tryacquire(anderson_t *const p_lock)
+{
+    unsigned ticket = atomic_load_explicit(&p_lock->m_ticket, memory_order_relaxed);
+    unsigned const idx = ticket & p_lock->m_mask;
+
+    // The next ticket's slot has already been granted, so the lock is free.
+    if (atomic_load_explicit(&p_lock->slots[idx].v, memory_order_acquire) == 0) {
+        return false;
+    }
+    if (!atomic_compare_exchange_strong_explicit(&p_lock->m_ticket, &ticket, ticket + 1, memory_order_acquire, memory_order_relaxed)) {
+        return false;
+    }
+    atomic_store_explicit(&p_lock->slots[idx].v, 0, memory_order_relaxed);
+    p_lock->m_owner = idx;
+    return true;
+}
+
+/**
+ * Reset an Anderson lock to unlocked.
+ *
+ * The caller sets slots to an array of nslots slots first.
+ *
+ * @param nslots Slot count, a power of 2
+ */
+static inline void
+anderson_reset(anderson_t *const p_lock, unsigned const nslots)
+{
+    atomic_store_explicit(&p_lock->m_ticket, 0, memory_order_relaxed);
+    p_lock->m_owner = 0;
+    p_lock->m_mask = nslots - 1;
+    for (unsigned i = 0; i < nslots; ++i) {
+        atomic_store_explicit(&p_lock->slots[i].v, i == 0, memory_order_relaxed);
+    }
+}
@@ -1,5 +1,72 @@
 #pragma once
 
+//
+// Spinning and backing off
+//
+// backoff() is the single pause (or yield on ARM) the locks use between
+// polls of a contended word.
+//
+// The locks actually go through backoff_wait() and backoff_wait_dist() with
+// a backoff_t on their stack, which pick a policy at compile time with
+// -DBACKOFF_POLICY=...
+//
+//  BACKOFF_DEFAULT  what each lock has always done, one pause per poll and
+//                   the ticket lock waits one pause per thread ahead of it
+//  BACKOFF_NONE     poll as fast as possible
+//  BACKOFF_PAUSE    one pause per poll everywhere
+//  BACKOFF_EXP      bounded exponential backoff with jitter
+//  BACKOFF_PROP     proportional to the distance to the front of the queue
+//                   for the locks that know it, one pause for the rest
+//  BACKOFF_YIELD    pause, then sched_yield() after spinning for a while
+//
+// The non-default policies measure their delays in handoffs, the time it
+// takes for a store on one cpu to be seen on another, converted to a number
+// of pauses, and kept in g_backoff. backoff_calibrate() in
+// backoff_calibrate.h measures both on the machine you're on; a pause is
+// anything from about 10 to 140 cycles depending on the generation, so a
+// fixed count of them doesn't carry over.
+//
+// With BACKOFF_DEFAULT none of this generates any code.
+//
+
+#include <stdint.h>
+
+#define BACKOFF_DEFAULT 0
+#define BACKOFF_NONE 1
+#define BACKOFF_PAUSE 2
+#define BACKOFF_EXP 3
+#define BACKOFF_PROP 4
+#define BACKOFF_YIELD 5
+
+#ifndef BACKOFF_POLICY
+#define BACKOFF_POLICY BACKOFF_DEFAULT
+#endif
+
+#if BACKOFF_POLICY == BACKOFF_DEFAULT
+#define BACKOFF_POLICY_NAME "default"
+#elif BACKOFF_POLICY == BACKOFF_NONE
+#define BACKOFF_POLICY_NAME "none"
+#elif BACKOFF_POLICY == BACKOFF_PAUSE
+#define BACKOFF_POLICY_NAME "pause"
+#elif BACKOFF_POLICY == BACKOFF_EXP
+#define BACKOFF_POLICY_NAME "exp"
+#elif BACKOFF_POLICY == BACKOFF_PROP
+#define BACKOFF_POLICY_NAME "prop"
+#elif BACKOFF_POLICY == BACKOFF_YIELD
+#define BACKOFF_POLICY_NAME "yield"
+#else
+#error "BACKOFF_POLICY must be one of the BACKOFF_ policies"
+#endif
+
+#if BACKOFF_POLICY == BACKOFF_YIELD
+#include <sched.h>
+#endif
+
+// The exponential delay goes up to this many handoffs
+#define BACKOFF_EXP_CAP_HANDOFFS 64u
+// Spin for this many handoffs before yielding
+#define BACKOFF_YIELD_HANDOFFS 256u
+
 #if defined(__x86_64__) || defined(__x86__)
 __attribute__((always_inline))
 static inline void
@@ -44,3 +111,119 @@ wfe(void) {
     backoff();
 }
 #endif
+
+#if BACKOFF_POLICY != BACKOFF_DEFAULT
+typedef struct {
+    // Cycles per pause and per handoff between cpus
+    uint64_t pause_cycles;
+    uint64_t handoff_cycles;
+    // Derived from the above by backoff_scale(), in pauses
+    unsigned exp_base;
+    unsigned exp_cap;
+    unsigned prop_unit;
+    unsigned yield_after;
+} backoff_params_t;
+
+// Until backoff_calibrate() is called assume a mid range machine
+__attribute__((weak)) backoff_params_t g_backoff = {
+    .pause_cycles = 40,
+    .handoff_cycles = 200,
+    .exp_base = 5,
+    .exp_cap = 5 * BACKOFF_EXP_CAP_HANDOFFS,
+    .prop_unit = 5,
+    .yield_after = 5 * BACKOFF_YIELD_HANDOFFS,
+};
+#endif
+
+typedef struct {
+    // Polls so far
+    unsigned m_spins;
+    // Current exponential delay in pauses
+    unsigned m_delay;
+    uint32_t m_rng;
+} backoff_t;
+
+#define BACKOFF_INIT { .m_spins = 0, .m_delay = 0, .m_rng = 0 }
+
+__attribute__((always_inline))
+static inline void
+backoff_pauses(unsigned const n)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        backoff();
+    }
+}
+
+#if BACKOFF_POLICY == BACKOFF_EXP
+__attribute__((noinline))
+static void
+backoff_exp(backoff_t *const p_bo)
+{
+    if (p_bo->m_delay == 0) {
+        p_bo->m_delay = g_backoff.exp_base;
+        // Waiters' stacks differ, which is all the jitter needs
+        p_bo->m_rng = (uint32_t)((uintptr_t)p_bo >> 4) | 1;
+    }
+
+    // xorshift32, anywhere from half to all of the current delay
+    uint32_t x = p_bo->m_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    p_bo->m_rng = x;
+
+    unsigned const delay = p_bo->m_delay;
+    backoff_pauses(delay / 2 + x % (delay - delay / 2 + 1));
+
+    p_bo->m_delay = delay * 2 < g_backoff.exp_cap ? delay * 2 : g_backoff.exp_cap;
+}
+#endif
+
+/**
+ * Back off between polls of a contended word.
+ *
+ * @param p_bo State for this wait, BACKOFF_INIT before the first poll.
+ */
+__attribute__((always_inline))
+static inline void
+backoff_wait(backoff_t *const p_bo)
+{
+#if BACKOFF_POLICY == BACKOFF_NONE
+    (void)p_bo;
+#elif BACKOFF_POLICY == BACKOFF_EXP
+    backoff_exp(p_bo);
+#elif BACKOFF_POLICY == BACKOFF_YIELD
+    if (++p_bo->m_spins > g_backoff.yield_after) {
+        sched_yield();
+    } else {
+        backoff();
+    }
+#else
+    (void)p_bo;
+    backoff();
+#endif
+}
+
+/**
+ * Back off between polls when we know how many threads are ahead of us.
+ *
+ * @param p_bo State for this wait, BACKOFF_INIT before the first poll.
+ * @param dist Number of threads ahead of us in the queue.
+ */
+__attribute__((always_inline))
+static inline void
+backoff_wait_dist(backoff_t *const p_bo, unsigned const dist)
+{
+#if BACKOFF_POLICY == BACKOFF_DEFAULT
+    (void)p_bo;
+    for (volatile unsigned i = 0; i < dist; ++i) {
+        backoff();
+    }
+#elif BACKOFF_POLICY == BACKOFF_PROP
+    (void)p_bo;
+    backoff_pauses(dist * g_backoff.prop_unit);
+#else
+    (void)dist;
+    backoff_wait(p_bo);
+#endif
+}
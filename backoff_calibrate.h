@@ -0,0 +1,102 @@
+#pragma once
+
+//
+// Backoff calibration for the benchmark drivers
+//
+// Measures the cost of a pause and of a cache line handoff between cpus and
+// scales the non-default backoff policies' delays (g_backoff in backoff.h)
+// to them. Kept apart from backoff.h so the locks themselves don't pull in
+// pthreads or the cycle counter.
+//
+// With BACKOFF_DEFAULT there is nothing to calibrate and this is empty.
+//
+
+#include "backoff.h"
+
+#if BACKOFF_POLICY != BACKOFF_DEFAULT
+
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cycles.h"
+
+/**
+ * Work out the delays in pauses from the measured costs.
+ */
+static inline void
+backoff_scale(uint64_t const pause_cycles, uint64_t const handoff_cycles)
+{
+    uint64_t const pause = pause_cycles != 0 ? pause_cycles : 1;
+    uint64_t unit = (handoff_cycles + pause - 1) / pause;
+    if (unit == 0) {
+        unit = 1;
+    }
+
+    g_backoff.pause_cycles = pause_cycles;
+    g_backoff.handoff_cycles = handoff_cycles;
+    g_backoff.prop_unit = (unsigned)unit;
+    g_backoff.exp_base = (unsigned)unit;
+    g_backoff.exp_cap = (unsigned)unit * BACKOFF_EXP_CAP_HANDOFFS;
+    g_backoff.yield_after = (unsigned)unit * BACKOFF_YIELD_HANDOFFS;
+}
+
+#define BACKOFF_CALIBRATE_PAUSES 1000u
+#define BACKOFF_CALIBRATE_ROUNDS 10000u
+
+static inline void *
+backoff_pong(void *const arg)
+{
+    atomic_uint *const word = arg;
+    for (unsigned i = 0; i < BACKOFF_CALIBRATE_ROUNDS; ++i) {
+        while (atomic_load_explicit(word, memory_order_acquire) != 2 * i + 1) {
+            backoff();
+        }
+        atomic_store_explicit(word, 2 * i + 2, memory_order_release);
+    }
+    return NULL;
+}
+
+/**
+ * Measure the cost of a pause and of handing a cache line between two cpus
+ * and scale the backoff delays to them.
+ *
+ * Takes a few milliseconds. The handoff is left at its default on a machine
+ * with a single cpu, where there's nothing to measure.
+ */
+static inline void
+backoff_calibrate(void)
+{
+    // Best of a few runs, we only want to see interruptions once
+    uint64_t pause = UINT64_MAX;
+    for (int r = 0; r < 5; ++r) {
+        uint64_t const start = cycles_now();
+        backoff_pauses(BACKOFF_CALIBRATE_PAUSES);
+        uint64_t const t = (cycles_now() - start) / BACKOFF_CALIBRATE_PAUSES;
+        pause = t < pause ? t : pause;
+    }
+
+    uint64_t handoff = g_backoff.handoff_cycles;
+    pthread_t thread;
+    static alignas(64) atomic_uint s_word;
+    atomic_store_explicit(&s_word, 0, memory_order_relaxed);
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1 && pthread_create(&thread, NULL, backoff_pong, &s_word) == 0) {
+        // Ping pong a line between us and the other thread, a round trip is
+        // two handoffs.
+        uint64_t const start = cycles_now();
+        for (unsigned i = 0; i < BACKOFF_CALIBRATE_ROUNDS; ++i) {
+            atomic_store_explicit(&s_word, 2 * i + 1, memory_order_release);
+            while (atomic_load_explicit(&s_word, memory_order_acquire) != 2 * i + 2) {
+                backoff();
+            }
+        }
+        handoff = (cycles_now() - start) / (2 * BACKOFF_CALIBRATE_ROUNDS);
+        pthread_join(thread, NULL);
+    }
+
+    backoff_scale(pause, handoff);
+}
+
+#endif
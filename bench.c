@@ -0,0 +1,1463 @@
+//
+// Linux benchmark driver for every lock in the repo.
+//
+// Each lock is run through the same workload: every thread is pinned to its
+// own CPU, waits for all the others to arrive, then acquires and releases the
+// lock num_iterations times with an optional random delay between releasing
+// and acquiring again (the collision prevention knob from real_test.c).
+//
+// The time from calling acquire to getting into the critical section is
+// recorded in a histogram per thread and the merged tail percentiles are
+// reported in cycles.
+//
+// The order the lock is handed out in is logged too, to report how fair
+// each lock is and how far the lock travels on each handoff (fair.h).
+//
+// Where the kernel allows it, each thread also counts cycles, instructions,
+// LLC misses, remote node loads and an optional raw event (-e) around its
+// loop with perf_event_open (perfctr.h). They're reported per acquisition.
+//
+// What happens inside and between the critical sections can be changed
+// with -w (workload.h): cache lines read and written, shared or private,
+// extra critical section and think time, and a hash table or queue payload.
+//
+// Built with -DLOCK_TRACE, -T records every acquisition into a trace
+// (trace.h) that replay.c can play back against the other locks.
+//
+// Built with -DLOCK_STATS, the contention counters from stats.h are printed
+// to stderr after each run.
+//
+// With -s the thread count is swept from 1 up under each placement policy
+// from topo.h to find where each lock's performance levels off or collapses.
+//
+// Progress goes to stderr and a CSV summary with one row per run goes to
+// stdout.
+//
+// gcc -O2 -pthread -o bench bench.c -lm
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include "cycles.h"
+#include "backoff_calibrate.h"
+#include "hist.h"
+#include "topo.h"
+#include "fair.h"
+#include "perfctr.h"
+#include "trace.h"
+#include "lock_list.h"
+#include "stats.h"
+#include "workload.h"
+#include "naive.h"
+#include "ticket.h"
+#include "ptick.h"
+#include "mcs.h"
+#include "gta.h"
+#include "gta_auto.h"
+#include "anderson.h"
+#include "cohort.h"
+#include "cna.h"
+#include "mcs_cr.h"
+#include "clh.h"
+#include "hemlock.h"
+#include "qspin.h"
+#include "mcs_park.h"
+#include "mcs_tp.h"
+#include "fc.h"
+#include "rcl.h"
+
+typedef struct {
+    long num_threads;
+    long num_iterations;
+    uint64_t collision_prevention;
+    uint64_t raw_event;
+    unsigned batch;
+    workload_t workload;
+    workload_data_t wl_data;
+    pthread_barrier_t barrier;
+    pthread_mutex_t m_pmtx;
+    uint64_t earliest_cc;
+    uint64_t latest_cc;
+    atomic_uint start_barrier;
+    // The cpus the threads of the current run are pinned to
+    cpu_set_t client_cpus;
+} test_state;
+
+typedef struct {
+    // The MCS node has to live as long as the thread holds the lock, keep it
+    // on its own line so it doesn't false share with the rest of the args.
+    mcs_t node;
+    // Kept between runs so the spin budget carries over
+    mcs_park_t park_node;
+    mcs_tp_node_t tp_node;
+    alignas(64) test_state *state;
+    // The CLH node this thread currently owns
+    clh_node_t *clh;
+    unsigned threadnum;
+    int corenum;
+    // Acquire latencies, allocated by the thread itself so the memory is
+    // local to it.
+    hist_t *hist;
+    // The sequence number of each of this thread's acquisitions
+    uint32_t *seqlog;
+    pmu_counts_t counts;
+} pthread_arg;
+
+typedef struct {
+    char const *name;
+    // Allocate and initialize the lock, return its size in bytes or 0 if it
+    // can't run in this configuration
+    size_t (*init)(test_state *st);
+    // Free anything init allocated besides the lock itself
+    void (*fini)(void *lock);
+    void *(*routine)(void *);
+} lock_impl;
+
+static volatile int *g_value;
+// Acquisition counter, protected by the lock and next to g_value
+static volatile uint32_t *g_seq;
+static void *g_lock;
+static topo_t g_topo;
+
+static inline unsigned
+xorshift32(unsigned *const rng_state)
+{
+    unsigned x = *rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng_state = x;
+    return *rng_state;
+}
+
+static void *
+alloc_pages(size_t const size)
+{
+    void *const p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu bytes\n", size);
+        abort();
+    }
+    return p;
+}
+
+static size_t
+lock_size(size_t const size)
+{
+    size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void
+no_fini(void *const lock)
+{
+    (void)lock;
+}
+
+//
+// Per-lock setup and acquire/release adapters.
+//
+// The adapters are always inlined into bench_routine() so the lock code is
+// generated in-line in each lock's worker loop just as it would be at a
+// real call site.
+//
+
+typedef void lock_fn(void *lock, pthread_arg *parg);
+
+// What one iteration does inside the lock, gathered up so that flat combining
+// can run it on another thread.
+typedef struct {
+    int volatile *value;
+    uint32_t volatile *seq;
+    // The owning thread's sequence log entry for this iteration
+    uint32_t *seqlog;
+    workload_t const *wl;
+    workload_data_t const *wl_data;
+    wl_line_t *private_lines;
+    uint64_t *wl_rng;
+} bench_cs_t;
+
+__attribute__((always_inline))
+static inline void
+bench_cs(bench_cs_t *const cs)
+{
+    uint32_t const seq = *cs->seq;
+    *cs->seq = seq + 1;
+    *cs->seqlog = seq;
+    // Alternate adding and subtracting. If two threads get into the
+    // critical section simultaneously it should be obvious.
+    *cs->value += 1;
+    *cs->value -= 1;
+    *cs->value += 1;
+    *cs->value -= 1;
+    *cs->value += 1;
+    *cs->value -= 1;
+    workload_cs(cs->wl, cs->wl_data, cs->private_lines, cs->wl_rng);
+}
+
+// Runs the critical section under the lock instead of acquire/release.
+typedef void exec_fn(void *lock, pthread_arg *parg, bench_cs_t *cs);
+
+static size_t
+naive_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(atomic_uint));
+    g_lock = alloc_pages(sz);
+    atomic_init((atomic_uint *)g_lock, 0);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+naive_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    acquire(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+naive_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    release(lock);
+}
+
+static size_t
+ticket_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(tick_t));
+    g_lock = alloc_pages(sz);
+    atomic_init(&((tick_t *)g_lock)->total, 0);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+ticket_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    ticket_acq(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+ticket_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    ticket_rel(lock);
+}
+
+static size_t
+ptick_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(ptick_t));
+    g_lock = alloc_pages(sz);
+    ptick_reset(g_lock);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+ptick_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    ptick_acq(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+ptick_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    ptick_rel(lock);
+}
+
+static size_t
+mcs_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(mcs_t));
+    g_lock = alloc_pages(sz);
+    *(mcs_t *)g_lock = (mcs_t) {
+        .m_next = NULL,
+        .m_locked = 0
+    };
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    mcs_acquire(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    mcs_release(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_bench_rel2(void *const lock, pthread_arg *const parg)
+{
+    mcs_release2(lock, &parg->node);
+}
+
+static size_t
+mcs_lock_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(mcs_lock_t));
+    g_lock = alloc_pages(sz);
+    mcs_lock_reset(g_lock);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_lock_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    mcs_lock(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_lock_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    mcs_unlock(lock);
+}
+
+static size_t
+fc_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(fc_t));
+    g_lock = alloc_pages(sz);
+    fc_reset(g_lock);
+    return sz;
+}
+
+static void *
+fc_bench_cs(void *const arg)
+{
+    bench_cs(arg);
+    return NULL;
+}
+
+__attribute__((always_inline))
+static inline void
+fc_bench_exec(void *const lock, pthread_arg *const parg, bench_cs_t *const cs)
+{
+    (void)parg;
+    (void)fc_execute(lock, fc_bench_cs, cs);
+}
+
+static size_t
+rcl_bench_init(test_state *const st)
+{
+    // The server needs a cpu of its own, otherwise this measures the server
+    // and a client taking turns on a cpu. Take the last one we're allowed
+    // that no thread is pinned to.
+    int cpu = -1;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int i = CPU_SETSIZE - 1; i >= 0; --i) {
+            if (CPU_ISSET(i, &allowed) && !CPU_ISSET(i, &st->client_cpus)) {
+                cpu = i;
+                break;
+            }
+        }
+    }
+    if (cpu < 0) {
+        fprintf(stderr, "Skipping rcl, no cpu left for the server with %ld threads\n", st->num_threads);
+        return 0;
+    }
+
+    // Lock header followed by a mailbox per thread.
+    size_t const sz = lock_size(sizeof(rcl_t) + st->num_threads * sizeof(rcl_mailbox_t));
+    rcl_t *const p_lock = alloc_pages(sz);
+    p_lock->m_mailboxes = (void *)((unsigned char *)p_lock + sizeof(rcl_t));
+    rcl_reset(p_lock, (unsigned)st->num_threads);
+
+    if (rcl_start(p_lock, cpu) != 0) {
+        fprintf(stderr, "Failed to start the RCL server\n");
+        abort();
+    }
+    g_lock = p_lock;
+    return sz;
+}
+
+static void
+rcl_bench_fini(void *const lock)
+{
+    rcl_stop(lock);
+}
+
+static void *
+rcl_bench_cs(void *const arg)
+{
+    bench_cs(arg);
+    return NULL;
+}
+
+__attribute__((always_inline))
+static inline void
+rcl_bench_exec(void *const lock, pthread_arg *const parg, bench_cs_t *const cs)
+{
+    (void)rcl_execute(lock, parg->threadnum, rcl_bench_cs, cs);
+}
+
+static size_t
+gta_init(test_state *const st)
+{
+    // Lock header followed by one slot per thread plus the initial slot.
+    size_t const sz = lock_size((st->num_threads + 2) * 64);
+    gta_t *const p_lock = alloc_pages(sz);
+    p_lock->slots = (void *)((unsigned char *)p_lock + 64);
+    p_lock->m_allocsz = sz;
+    gta_reset(p_lock);
+    g_lock = p_lock;
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+gta_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    // Slot 0 is the initial tail so thread n uses slot n + 1.
+    gta_acquire(lock, parg->threadnum + 1);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    gta_release(lock, parg->threadnum + 1);
+}
+
+static size_t
+gta_auto_bench_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(gta_auto_t));
+    g_lock = alloc_pages(sz);
+    gta_auto_init(g_lock);
+    return sz;
+}
+
+static void
+gta_auto_bench_fini(void *const lock)
+{
+    gta_auto_destroy(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    gta_auto_acquire(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    gta_auto_release(lock);
+}
+
+static size_t
+anderson_init(test_state *const st)
+{
+    // Lock header followed by a slot per thread, rounded up.
+    unsigned const nslots = anderson_slot_count((unsigned)st->num_threads);
+    size_t const sz = lock_size(sizeof(anderson_t) + nslots * sizeof(gs_t));
+    anderson_t *const p_lock = alloc_pages(sz);
+    p_lock->slots = (void *)(p_lock + 1);
+    p_lock->m_allocsz = sz;
+    anderson_reset(p_lock, nslots);
+    g_lock = p_lock;
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+anderson_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    anderson_acquire(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+anderson_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    anderson_release(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_cr_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    mcs_cr_acquire(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_cr_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    mcs_cr_release(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+cna_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    cna_acquire(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+cna_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    cna_release(lock, &parg->node);
+}
+
+static size_t
+clh_init(test_state *const st)
+{
+    // Lock header followed by the initial node and one node per thread.
+    size_t const sz = lock_size((st->num_threads + 2) * 64);
+    clh_t *const p_lock = alloc_pages(sz);
+    clh_reset(p_lock, (void *)((unsigned char *)p_lock + 64));
+    g_lock = p_lock;
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+clh_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    clh_acquire(lock, &parg->clh);
+}
+
+__attribute__((always_inline))
+static inline void
+clh_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    clh_release(lock, &parg->clh);
+}
+
+static size_t
+hemlock_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(hemlock_t));
+    g_lock = alloc_pages(sz);
+    hemlock_reset(g_lock);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+hemlock_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    hemlock_acquire(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+hemlock_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    hemlock_release(lock);
+}
+
+static size_t
+qspin_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(qspin_t));
+    g_lock = alloc_pages(sz);
+    qspin_reset(g_lock);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+qspin_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    qspin_acquire(lock);
+}
+
+__attribute__((always_inline))
+static inline void
+qspin_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    (void)parg;
+    qspin_release(lock);
+}
+
+static size_t
+mcs_park_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(mcs_park_t));
+    g_lock = alloc_pages(sz);
+    *(mcs_park_t *)g_lock = (mcs_park_t)MCS_PARK_INITIALIZER;
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_park_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    mcs_park_acquire(lock, &parg->park_node);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_park_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    mcs_park_release(lock, &parg->park_node);
+}
+
+static size_t
+mcs_tp_init(test_state *const st)
+{
+    (void)st;
+    size_t const sz = lock_size(sizeof(mcs_tp_t));
+    g_lock = alloc_pages(sz);
+    mcs_tp_reset(g_lock, MCS_TP_PATIENCE_NS);
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_tp_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    mcs_tp_acquire(lock, &parg->tp_node);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_tp_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    mcs_tp_release(lock, &parg->tp_node);
+}
+
+static size_t
+cohort_init(test_state *const st)
+{
+    // Lock header followed by one local MCS lock per NUMA node.
+    unsigned const nnodes = numa_node_count();
+    size_t const sz = lock_size(sizeof(cohort_t) + nnodes * sizeof(mcs_t));
+    cohort_t *const p_lock = alloc_pages(sz);
+    cohort_reset(p_lock, (void *)((unsigned char *)p_lock + sizeof(cohort_t)), nnodes, st->batch);
+    g_lock = p_lock;
+    return sz;
+}
+
+__attribute__((always_inline))
+static inline void
+cohort_bench_acq(void *const lock, pthread_arg *const parg)
+{
+    cohort_acquire(lock, &parg->node);
+}
+
+__attribute__((always_inline))
+static inline void
+cohort_bench_rel(void *const lock, pthread_arg *const parg)
+{
+    cohort_release(lock, &parg->node);
+}
+
+static void
+pin_to_cpu(int const cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int const status = sched_setaffinity(0, sizeof(set), &set);
+    if (status != 0) {
+        fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+        abort();
+    }
+}
+
+/**
+ * The worker loop. Takes the lock with lock/unlock around each critical
+ * section, or if exec isn't NULL hands the critical section to it instead.
+ */
+__attribute__((always_inline))
+static inline void *
+bench_run(pthread_arg *const parg, lock_fn *const lock, lock_fn *const unlock, exec_fn *const exec)
+{
+    test_state *const st = parg->state;
+    unsigned rng_state = ((unsigned)time(NULL) ^ (unsigned)getpid()) * (parg->threadnum + 1);
+    for (int i = 0; i < 1000; ++i) {
+        (void)xorshift32(&rng_state);
+    }
+
+    pin_to_cpu(parg->corenum);
+
+    hist_t *const l_hist = aligned_alloc(64, sizeof(*l_hist));
+    if (l_hist == NULL) {
+        fprintf(stderr, "Failed to allocate histogram\n");
+        abort();
+    }
+    hist_reset(l_hist);
+    parg->hist = l_hist;
+
+    uint32_t *const l_seqlog = malloc(st->num_iterations * sizeof(*l_seqlog));
+    if (l_seqlog == NULL) {
+        fprintf(stderr, "Failed to allocate sequence log\n");
+        abort();
+    }
+    parg->seqlog = l_seqlog;
+
+    workload_t const wl = st->workload;
+    workload_data_t const wl_data = st->wl_data;
+    wl_line_t *const l_private = workload_alloc_lines(&wl);
+    if (wl.private_lines && workload_lines(&wl) != 0 && l_private == NULL) {
+        fprintf(stderr, "Failed to allocate workload lines\n");
+        abort();
+    }
+    uint64_t wl_rng = ((uint64_t)rng_state << 32) | (parg->threadnum + 1);
+
+    pmu_group_t pmu;
+    (void)pmu_open(&pmu, st->raw_event);
+
+    uint64_t const collide_prot = st->collision_prevention;
+    long const num_iterations = st->num_iterations;
+
+    pthread_barrier_wait(&st->barrier);
+
+    void *const l_lock = g_lock;
+    int volatile*const l_value = g_value;
+    uint32_t volatile*const l_seq = g_seq;
+
+    // Spin until all threads are running on their cores
+    atomic_fetch_add(&st->start_barrier, 1);
+    while (atomic_load(&st->start_barrier) < st->num_threads) {
+        backoff();
+    }
+
+    pmu_start(&pmu);
+    uint64_t const cc1 = cycles_now();
+    for (long i = 0; i < num_iterations; ++i) {
+        unsigned const t = xorshift32(&rng_state) & collide_prot;
+        for (volatile unsigned j = 0; j < t; ++j) {
+        }
+        workload_think(&wl, &wl_rng);
+        bench_cs_t cs = {
+            .value = l_value,
+            .seq = l_seq,
+            .seqlog = &l_seqlog[i],
+            .wl = &wl,
+            .wl_data = &wl_data,
+            .private_lines = l_private,
+            .wl_rng = &wl_rng,
+        };
+        if (exec != NULL) {
+            // Latency is to the critical section being done, wherever it ran.
+            // The trace has nothing to say about who held the lock.
+            uint64_t const t1 = cycles_now();
+            exec(l_lock, parg, &cs);
+            hist_record(l_hist, cycles_now() - t1);
+            continue;
+        }
+        TRACE_REQUEST(0);
+        uint64_t const t1 = cycles_now();
+        lock(l_lock, parg);
+        uint64_t const t2 = cycles_now();
+        TRACE_ACQUIRED(0);
+        hist_record(l_hist, t2 - t1);
+        bench_cs(&cs);
+        TRACE_RELEASED(0);
+        unlock(l_lock, parg);
+    }
+    uint64_t const cc2 = cycles_now();
+    pmu_stop(&pmu);
+
+    pmu_read(&pmu, &parg->counts);
+    pmu_close(&pmu);
+    free(l_private);
+
+    pthread_mutex_lock(&st->m_pmtx);
+    if (cc1 < st->earliest_cc) {
+        st->earliest_cc = cc1;
+    }
+    if (cc2 > st->latest_cc) {
+        st->latest_cc = cc2;
+    }
+    pthread_mutex_unlock(&st->m_pmtx);
+
+    return NULL;
+}
+
+__attribute__((always_inline))
+static inline void *
+bench_routine(pthread_arg *const parg, lock_fn *const lock, lock_fn *const unlock)
+{
+    return bench_run(parg, lock, unlock, NULL);
+}
+
+static void *
+naive_routine(void *const arg)
+{
+    return bench_routine(arg, naive_bench_acq, naive_bench_rel);
+}
+
+static void *
+ticket_routine(void *const arg)
+{
+    return bench_routine(arg, ticket_bench_acq, ticket_bench_rel);
+}
+
+static void *
+ptick_routine(void *const arg)
+{
+    return bench_routine(arg, ptick_bench_acq, ptick_bench_rel);
+}
+
+static void *
+mcs_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_bench_acq, mcs_bench_rel);
+}
+
+static void *
+mcs2_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_bench_acq, mcs_bench_rel2);
+}
+
+static void *
+mcs_lock_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_lock_bench_acq, mcs_lock_bench_rel);
+}
+
+static void *
+fc_routine(void *const arg)
+{
+    return bench_run(arg, NULL, NULL, fc_bench_exec);
+}
+
+static void *
+rcl_routine(void *const arg)
+{
+    return bench_run(arg, NULL, NULL, rcl_bench_exec);
+}
+
+static void *
+gta_routine(void *const arg)
+{
+    return bench_routine(arg, gta_bench_acq, gta_bench_rel);
+}
+
+static void *
+gta_auto_routine(void *const arg)
+{
+    return bench_routine(arg, gta_auto_bench_acq, gta_auto_bench_rel);
+}
+
+static void *
+anderson_routine(void *const arg)
+{
+    return bench_routine(arg, anderson_bench_acq, anderson_bench_rel);
+}
+
+static void *
+cohort_routine(void *const arg)
+{
+    return bench_routine(arg, cohort_bench_acq, cohort_bench_rel);
+}
+
+static void *
+mcs_cr_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_cr_bench_acq, mcs_cr_bench_rel);
+}
+
+static void *
+cna_routine(void *const arg)
+{
+    return bench_routine(arg, cna_bench_acq, cna_bench_rel);
+}
+
+static void *
+clh_routine(void *const arg)
+{
+    pthread_arg *const parg = arg;
+    // Thread n starts with node n + 1, node 0 is the lock's initial node
+    parg->clh = (clh_node_t *)((unsigned char *)g_lock + 64) + parg->threadnum + 1;
+    return bench_routine(arg, clh_bench_acq, clh_bench_rel);
+}
+
+static void *
+hemlock_routine(void *const arg)
+{
+    return bench_routine(arg, hemlock_bench_acq, hemlock_bench_rel);
+}
+
+static void *
+qspin_routine(void *const arg)
+{
+    return bench_routine(arg, qspin_bench_acq, qspin_bench_rel);
+}
+
+static void *
+mcs_park_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_park_bench_acq, mcs_park_bench_rel);
+}
+
+static void *
+mcs_tp_routine(void *const arg)
+{
+    return bench_routine(arg, mcs_tp_bench_acq, mcs_tp_bench_rel);
+}
+
+static lock_impl const g_impls[] = {
+    { "naive",  naive_init,  no_fini,  naive_routine },
+    { "ticket", ticket_init, no_fini,  ticket_routine },
+    { "ptick",  ptick_init,  no_fini,  ptick_routine },
+    { "mcs",    mcs_init,    no_fini,  mcs_routine },
+    { "mcs2",   mcs_init,    no_fini,  mcs2_routine },
+    { "mcslock", mcs_lock_init, no_fini, mcs_lock_routine },
+    { "fc",     fc_init,     no_fini,  fc_routine },
+    { "rcl",    rcl_bench_init, rcl_bench_fini, rcl_routine },
+    { "mcspark", mcs_park_init, no_fini, mcs_park_routine },
+    { "mcstp",  mcs_tp_init, no_fini,  mcs_tp_routine },
+    { "gta",    gta_init,    no_fini,  gta_routine },
+    { "gtaauto", gta_auto_bench_init, gta_auto_bench_fini, gta_auto_routine },
+    { "anderson", anderson_init, no_fini, anderson_routine },
+    { "clh",    clh_init,    no_fini,  clh_routine },
+    { "hemlock", hemlock_init, no_fini, hemlock_routine },
+    { "qspin",  qspin_init,  no_fini,  qspin_routine },
+    { "cohort", cohort_init, no_fini,  cohort_routine },
+    { "cna",    mcs_init,    no_fini,  cna_routine },
+    { "mcscr",  mcs_init,    no_fini,  mcs_cr_routine },
+};
+
+#define NUM_IMPLS (sizeof(g_impls) / sizeof(g_impls[0]))
+
+/**
+ * Time the workload with no lock at all so it can be subtracted out.
+ */
+static uint64_t
+get_overhead(test_state *const st)
+{
+    int volatile*const l_value = g_value;
+    uint32_t volatile*const l_seq = g_seq;
+    uint32_t *const l_seqlog = malloc(st->num_iterations * sizeof(*l_seqlog));
+    if (l_seqlog == NULL) {
+        fprintf(stderr, "Failed to allocate sequence log\n");
+        abort();
+    }
+
+    // Include the cost of timing the acquire
+    static hist_t s_hist;
+    hist_reset(&s_hist);
+
+    unsigned rng_state = (unsigned)time(NULL) ^ (unsigned)getpid();
+    for (int i = 0; i < 1000; ++i) {
+        (void)xorshift32(&rng_state);
+    }
+
+    uint64_t const collide_prot = st->collision_prevention;
+
+    workload_t const wl = st->workload;
+    workload_data_t const wl_data = st->wl_data;
+    wl_line_t *const l_private = workload_alloc_lines(&wl);
+    if (wl.private_lines && workload_lines(&wl) != 0 && l_private == NULL) {
+        fprintf(stderr, "Failed to allocate workload lines\n");
+        abort();
+    }
+    uint64_t wl_rng = (uint64_t)rng_state << 32 | 1;
+
+    uint64_t const cc1 = cycles_now();
+    for (long i = 0; i < st->num_iterations; ++i) {
+        unsigned const t = xorshift32(&rng_state) & collide_prot;
+        for (volatile unsigned j = 0; j < t; ++j) {
+        }
+        workload_think(&wl, &wl_rng);
+        uint64_t const t1 = cycles_now();
+        uint64_t const t2 = cycles_now();
+        hist_record(&s_hist, t2 - t1);
+        uint32_t const seq = *l_seq;
+        *l_seq = seq + 1;
+        l_seqlog[i] = seq;
+        *l_value += 1;
+        *l_value -= 1;
+        *l_value += 1;
+        *l_value -= 1;
+        *l_value += 1;
+        *l_value -= 1;
+        workload_cs(&wl, &wl_data, l_private, &wl_rng);
+    }
+    uint64_t const cc2 = cycles_now();
+
+    free(l_private);
+    free(l_seqlog);
+
+    return cc2 - cc1;
+}
+
+static void
+run_lock(test_state *const st, lock_impl const *const impl, pthread_arg *const pargs,
+        pthread_t *const threads, char const *const place_name, double const overhead)
+{
+    size_t const sz = impl->init(st);
+    if (sz == 0) {
+        return;
+    }
+
+#ifdef LOCK_STATS
+    lock_stats_t stats_before[LOCK_STATS_KINDS];
+    lock_stats_snapshot(stats_before);
+#endif
+
+    pthread_barrier_init(&st->barrier, NULL, st->num_threads + 1);
+
+    st->start_barrier = 0;
+    *g_seq = 0;
+    st->earliest_cc = UINT64_MAX;
+    st->latest_cc = 0;
+
+    for (long i = 0; i < st->num_threads; ++i) {
+        int const status = pthread_create(&threads[i], NULL, impl->routine, (void *)&pargs[i]);
+        if (status != 0) {
+            fprintf(stderr, "Failed to create thread %ld\n", i);
+            abort();
+        }
+    }
+
+    pthread_barrier_wait(&st->barrier);
+
+    static hist_t s_hist;
+    hist_reset(&s_hist);
+    pmu_counts_t pmu;
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        pmu.valid[e] = true;
+        pmu.values[e] = 0;
+    }
+    for (long i = 0; i < st->num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+        pmu_merge(&pmu, &pargs[i].counts);
+        hist_merge(&s_hist, pargs[i].hist);
+        free(pargs[i].hist);
+        pargs[i].hist = NULL;
+    }
+
+#ifdef LOCK_STATS
+    lock_stats_t stats_after[LOCK_STATS_KINDS];
+    lock_stats_snapshot(stats_after);
+    fprintf(stderr, "%s %ld threads: ", impl->name, st->num_threads);
+    lock_stats_print(stderr, stats_before, stats_after);
+#endif
+
+    uint32_t **const logs = malloc(st->num_threads * sizeof(*logs));
+    int *const cpus = malloc(st->num_threads * sizeof(*cpus));
+    uint64_t *const counts = malloc(st->num_threads * sizeof(*counts));
+    if (logs == NULL || cpus == NULL || counts == NULL) {
+        fprintf(stderr, "Failed to allocate fairness state\n");
+        abort();
+    }
+    for (long i = 0; i < st->num_threads; ++i) {
+        logs[i] = pargs[i].seqlog;
+        cpus[i] = pargs[i].corenum;
+    }
+    fair_result_t fair;
+    if (fair_analyze(logs, st->num_threads, st->num_iterations, cpus, &g_topo, counts, &fair) != 0) {
+        fprintf(stderr, "Invalid acquisition sequence from the %s lock\n", impl->name);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_destroy(&st->barrier);
+    impl->fini(g_lock);
+    munmap(g_lock, sz);
+    g_lock = NULL;
+
+    if (*g_value != 0) {
+        fprintf(stderr, "Mutual exclusion violated by the %s lock (value %d)\n", impl->name, *g_value);
+        exit(EXIT_FAILURE);
+    }
+
+    double const cpns = (double)cycles_per_sec() / NSEC_PER_SECOND;
+    uint64_t const cc_diff = st->latest_cc - st->earliest_cc;
+    uint64_t const num_crit = st->num_threads * st->num_iterations;
+    double const cycles_per_acq = (double)cc_diff / num_crit;
+
+    fprintf(stderr, "%s: %"PRIu64" cycles for %"PRIu64" acquisitions\n", impl->name, cc_diff, num_crit);
+    fprintf(stderr, "%s: acquisitions per thread in the first %"PRIu64":", impl->name, fair.window);
+    for (long i = 0; i < st->num_threads; ++i) {
+        fprintf(stderr, " %"PRIu64, counts[i]);
+    }
+    fprintf(stderr, "\n");
+
+    double const nhandoffs = fair.window > 1 ? (double)(fair.window - 1) : 1.0;
+
+    char wl_desc[256];
+    workload_describe(&st->workload, wl_desc, sizeof(wl_desc));
+
+    printf("%s,%s,%ld,%ld,%"PRIu64",%s,%"PRIu64",%.2f,%.2f,%.2f,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%.4f,%"PRIu64",%.4f,%.4f,%.4f,%.4f,%.4f",
+            impl->name, place_name, st->num_threads, st->num_iterations, st->collision_prevention, wl_desc,
+            cc_diff, cycles_per_acq, cycles_per_acq / cpns, overhead,
+            hist_percentile(&s_hist, 50.0), hist_percentile(&s_hist, 99.0),
+            hist_percentile(&s_hist, 99.9), s_hist.max,
+            fair.jain, fair.max_starve,
+            fair.handoffs[HANDOFF_SELF] / nhandoffs, fair.handoffs[HANDOFF_CORE] / nhandoffs,
+            fair.handoffs[HANDOFF_LLC] / nhandoffs, fair.handoffs[HANDOFF_NODE] / nhandoffs,
+            fair.handoffs[HANDOFF_REMOTE] / nhandoffs);
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        if (pmu.valid[e]) {
+            printf(",%.3f", (double)pmu.values[e] / num_crit);
+        } else {
+            printf(",");
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+
+    for (long i = 0; i < st->num_threads; ++i) {
+        free(pargs[i].seqlog);
+        pargs[i].seqlog = NULL;
+    }
+    free(counts);
+    free(cpus);
+    free(logs);
+}
+
+static void
+usage(char const *const prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l lock] [-t threads] [-c coremask] [-P placement] [-s] [-n iterations] [-p bits] [-r runs] [-o factor] [-b batch] [-w workload] [-e event] [-T trace]\n"
+            "  -l  comma separated locks to run (default all):", prog);
+    for (size_t i = 0; i < NUM_IMPLS; ++i) {
+        fprintf(stderr, " %s", g_impls[i].name);
+    }
+    fprintf(stderr,
+            "\n"
+            "  -t  number of threads, pinned to the first usable cpus (default 1)\n"
+            "  -c  cores to use as a string of 0/1 per cpu, e.g. 0110 (overrides -t, not with -s or -P)\n"
+            "  -P  place threads by topology:");
+    for (int i = 0; i < PLACE_COUNT; ++i) {
+        fprintf(stderr, " %s", g_placement_names[i]);
+    }
+    fprintf(stderr,
+            "\n"
+            "  -s  sweep from 1 to the -t thread count under each placement (or just -P)\n"
+            "  -n  iterations per thread (default 10000)\n"
+            "  -p  random delay of up to 2^bits - 1 loops between acquisitions (default 0)\n"
+            "  -r  number of times to run each lock (default 1)\n"
+            "  -o  oversubscribe, run factor threads on every cpu (overrides -t)\n"
+            "  -b  handoffs within a NUMA node before the cohort lock moves on (default %u)\n"
+            "  -w  critical section workload, e.g. read=4,write=2,private,cs=200,think=exp:1000,payload=hash\n"
+            "  -e  raw PMU event to count in hex, e.g. a remote HITM event for the cpu\n"
+            "  -T  record the acquisitions to a trace file (needs -DLOCK_TRACE)\n",
+            COHORT_DEFAULT_BATCH);
+}
+
+int
+main(int argc, char **argv)
+{
+    test_state *const st = malloc(sizeof(*st));
+    if (st == NULL) {
+        fprintf(stderr, "Failed to alloc test state\n");
+        abort();
+    }
+    memset(st, 0, sizeof(*st));
+
+    st->num_threads = 1;
+    st->num_iterations = 10000;
+    st->batch = COHORT_DEFAULT_BATCH;
+
+    char const *lock_name = "all";
+    char const *coremask = NULL;
+    long num_runs = 1;
+    long oversub = 0;
+    placement_t placement = PLACE_COUNT;
+    bool sweep = false;
+    char const *trace_path = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "l:t:c:n:p:r:o:b:P:e:T:w:sh")) != -1) {
+        switch (c) {
+        case 'l':
+            lock_name = optarg;
+            break;
+        case 't':
+            st->num_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            coremask = optarg;
+            break;
+        case 'n':
+            st->num_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'p': {
+            long const bits = strtol(optarg, NULL, 10);
+            st->collision_prevention = (UINT64_C(1) << bits) - 1;
+            break;
+        }
+        case 'r':
+            num_runs = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            oversub = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            st->batch = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            placement = topo_parse_placement(optarg);
+            if (placement == PLACE_COUNT) {
+                fprintf(stderr, "Unknown placement %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sweep = true;
+            break;
+        case 'w':
+            if (workload_parse(&st->workload, optarg) != 0) {
+                fprintf(stderr, "Bad workload %s\n", optarg);
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            st->raw_event = strtoull(optarg, NULL, 16);
+            break;
+        case 'T':
+#ifdef LOCK_TRACE
+            trace_path = optarg;
+            break;
+#else
+            fprintf(stderr, "Recording a trace needs bench built with -DLOCK_TRACE\n");
+            return EXIT_FAILURE;
+#endif
+        case 'h':
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (coremask != NULL && (sweep || placement != PLACE_COUNT)) {
+        // The mask already says which cpus to use and in what order
+        fprintf(stderr, "-c can't be combined with -s or -P\n");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char const *names[NUM_IMPLS];
+    for (size_t i = 0; i < NUM_IMPLS; ++i) {
+        names[i] = g_impls[i].name;
+    }
+    size_t unknown_len;
+    char const *const unknown = lock_list_unknown(lock_name, names, NUM_IMPLS, &unknown_len);
+    if (unknown != NULL) {
+        fprintf(stderr, "Unknown lock %.*s\n", (int)unknown_len, unknown);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    bool run_impl[NUM_IMPLS] = { false };
+    for (size_t i = 0; i < NUM_IMPLS; ++i) {
+        run_impl[i] = lock_selected(lock_name, g_impls[i].name);
+    }
+
+    // Pick the cpus to run on, either from the mask, the placement policy or
+    // just the usable ones in order.
+    topo_t *const topo = &g_topo;
+    if (topo_load(topo) != 0) {
+        fprintf(stderr, "Failed to read the cpu topology\n");
+        abort();
+    }
+
+    int *const order = malloc((topo->ncpus + CPU_SETSIZE) * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "Failed to allocate cpu order\n");
+        abort();
+    }
+
+    int ncpus = 0;
+    if (coremask != NULL) {
+        for (int i = 0; coremask[i] != '\0' && i < CPU_SETSIZE; ++i) {
+            if (coremask[i] != '0') {
+                order[ncpus++] = i;
+            }
+        }
+        st->num_threads = ncpus;
+    } else {
+        for (int i = 0; i < topo->ncpus; ++i) {
+            order[ncpus++] = topo->cpus[i].cpu;
+        }
+    }
+
+    if (oversub > 0) {
+        st->num_threads = oversub * ncpus;
+    }
+
+    if (st->num_threads < 1 || st->num_iterations < 1 || ncpus < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (st->num_threads > ncpus && oversub == 0) {
+        fprintf(stderr, "Warning: %ld threads on %d cpus, threads will share cpus\n",
+                st->num_threads, ncpus);
+    }
+
+    long const max_threads = st->num_threads;
+
+    pthread_t *const threads = malloc(max_threads * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate threads\n");
+        abort();
+    }
+
+    pthread_arg *const pargs = aligned_alloc(64, max_threads * sizeof(*pargs));
+    if (pargs == NULL) {
+        fprintf(stderr, "Failed to allocate args\n");
+        abort();
+    }
+
+    for (long i = 0; i < max_threads; ++i) {
+        memset(&pargs[i], 0, sizeof(pargs[i]));
+        pargs[i].state = st;
+        pargs[i].threadnum = (unsigned)i;
+    }
+
+    int const status = pthread_mutex_init(&st->m_pmtx, NULL);
+    assert(status == 0);
+    (void)status;
+
+    // Put g_value in its own special location to prevent any false sharing
+    g_value = alloc_pages(lock_size(sizeof(*g_value) + sizeof(*g_seq)));
+    *g_value = 0;
+    g_seq = (void *)(g_value + 1);
+    *g_seq = 0;
+
+    if (workload_init(&st->workload, &st->wl_data) != 0) {
+        fprintf(stderr, "Failed to allocate the workload data\n");
+        abort();
+    }
+
+    (void)cycles_per_sec();
+
+#if BACKOFF_POLICY != BACKOFF_DEFAULT
+    backoff_calibrate();
+    fprintf(stderr, "Backoff %s: %" PRIu64 " cycles per pause, %" PRIu64 " cycles per handoff\n",
+            BACKOFF_POLICY_NAME, g_backoff.pause_cycles, g_backoff.handoff_cycles);
+#endif
+
+    pmu_group_t pmu;
+    unsigned const npmu = pmu_open(&pmu, st->raw_event);
+    if (npmu == 0) {
+        fprintf(stderr, "Warning: hardware counters are unavailable, the pmu columns will be empty\n");
+    } else if (npmu < PMU_COUNT - (st->raw_event == 0)) {
+        fprintf(stderr, "Warning: only %u of the hardware counters are available\n", npmu);
+    }
+    pmu_close(&pmu);
+    double const overhead = (double)get_overhead(st) / st->num_iterations;
+
+    if (trace_path != NULL) {
+        // Keep everything from a default run
+        trace_start((uint64_t)st->num_iterations * 3);
+    }
+
+    printf("lock,placement,threads,iterations,delay_mask,workload,total_cycles,cycles_per_acq,ns_per_acq,overhead_cycles,acq_p50,acq_p99,acq_p999,acq_max,jain,max_starve,ho_self,ho_core,ho_llc,ho_node,ho_remote");
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        printf(",pmu_%s", g_pmu_names[e]);
+    }
+    printf("\n");
+
+    for (int p = 0; p < PLACE_COUNT + 1; ++p) {
+        char const *place_name;
+        if (p == PLACE_COUNT) {
+            // Not a policy, the mask or cpu id order
+            if (placement != PLACE_COUNT || sweep) {
+                break;
+            }
+            place_name = coremask != NULL ? "mask" : "linear";
+        } else {
+            if (coremask != NULL || (placement != PLACE_COUNT && placement != (placement_t)p)) {
+                continue;
+            }
+            if (placement == PLACE_COUNT && !sweep) {
+                continue;
+            }
+            place_name = g_placement_names[p];
+            topo_order(topo, (placement_t)p, order);
+        }
+
+        for (long n = sweep ? 1 : max_threads; n <= max_threads; ++n) {
+            st->num_threads = n;
+            CPU_ZERO(&st->client_cpus);
+            for (long i = 0; i < n; ++i) {
+                // Wrap around if there are more threads than cpus
+                pargs[i].corenum = order[i % ncpus];
+                CPU_SET(pargs[i].corenum, &st->client_cpus);
+                if (!sweep) {
+                    fprintf(stderr, "Putting thread %ld on core %d\n", i, pargs[i].corenum);
+                }
+            }
+
+            for (long r = 0; r < num_runs; ++r) {
+                for (size_t i = 0; i < NUM_IMPLS; ++i) {
+                    if (run_impl[i]) {
+                        run_lock(st, &g_impls[i], pargs, threads, place_name, overhead);
+                    }
+                }
+            }
+        }
+    }
+
+    topo_free(topo);
+    workload_fini(&st->wl_data);
+
+    if (trace_path != NULL) {
+        trace_stop();
+        if (trace_dump(trace_path) != 0) {
+            fprintf(stderr, "Failed to write the trace to %s\n", trace_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Build bench.c once per BACKOFF_POLICY (see backoff.h) and run every lock
+# with each one at high, medium and low contention.
+#
+# usage: ./bench_backoff.sh [threads] [iterations] [runs]
+#
+# The CSV on stdout is bench's with policy and contention columns in front.
+#
+
+set -eu
+
+THREADS=${1:-$(nproc)}
+ITERATIONS=${2:-100000}
+RUNS=${3:-5}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+
+# -p delay mask bits between acquisitions
+CONTENTION="high:0 medium:6 low:12"
+
+cd "$(dirname "$0")"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+header=1
+for policy in BACKOFF_DEFAULT BACKOFF_NONE BACKOFF_PAUSE BACKOFF_EXP BACKOFF_PROP BACKOFF_YIELD; do
+    bin="$tmp/bench_${policy}"
+    $CC $CFLAGS -pthread -DBACKOFF_POLICY=$policy -o "$bin" bench.c -lm
+
+    for level in $CONTENTION; do
+        name=${level%%:*}
+        bits=${level#*:}
+        "$bin" -l all -t "$THREADS" -n "$ITERATIONS" -r "$RUNS" -p "$bits" | {
+            read -r line
+            if [ $header -eq 1 ]; then
+                echo "policy,contention,$line"
+            fi
+            while read -r line; do
+                echo "$policy,$name,$line"
+            done
+        }
+        header=0
+    done
+done
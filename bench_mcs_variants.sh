@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Build bench.c once per MCS_SPIN_WAIT x MCS_RELEASE combination (see mcs.h)
+# and run each one at high, medium and low contention.
+#
+# usage: ./bench_mcs_variants.sh [threads] [iterations] [runs]
+#
+# The CSV on stdout is bench's with spin and release columns in front.
+#
+
+set -eu
+
+THREADS=${1:-$(nproc)}
+ITERATIONS=${2:-100000}
+RUNS=${3:-5}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+
+# -p delay mask bits between acquisitions
+CONTENTION="high:0 medium:6 low:12"
+
+cd "$(dirname "$0")"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+header=1
+for spin in MCS_SPIN_FENCE MCS_SPIN_ACQUIRE; do
+    for release in MCS_RELEASE_CAS MCS_RELEASE_XCHG; do
+        bin="$tmp/bench_${spin}_${release}"
+        $CC $CFLAGS -pthread -DMCS_SPIN_WAIT=$spin -DMCS_RELEASE=$release -o "$bin" bench.c -lm
+
+        for level in $CONTENTION; do
+            name=${level%%:*}
+            bits=${level#*:}
+            "$bin" -l mcs -t "$THREADS" -n "$ITERATIONS" -r "$RUNS" -p "$bits" | {
+                read -r line
+                if [ $header -eq 1 ]; then
+                    echo "spin,release,contention,$line"
+                fi
+                while read -r line; do
+                    echo "$spin,$release,$name,$line"
+                done
+            }
+            header=0
+        done
+    done
+done
@@ -0,0 +1,110 @@
+#pragma once
+
+//
+// Craig, Landin and Hagersten's Queue Lock
+//
+// Like MCS, every waiter spins on its own cache line. The difference is
+// which line: a CLH waiter spins on its predecessor's node instead of its
+// own, so nobody has to link themselves into the node ahead of them.
+//
+// That means releasing is a single store to the owner's own node. There is
+// no equivalent of the MCS release where the CAS fails and the owner has to
+// wait for its successor to write m_next.
+//
+// The cost is that nodes move between threads. When a thread releases the
+// lock its successor may still be reading its node, so the thread takes over
+// its predecessor's node (which nobody is looking at any more) and uses that
+// next time. The lock always holds on to one node, the one the last owner
+// released, which starts out as the node passed to clh_reset.
+//
+// So every thread has to start with a node of its own, and every node has to
+// outlive every lock and thread it could end up with.
+//
+
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+
+typedef struct clh_node clh_node_t;
+struct clh_node {
+    alignas(64) atomic_uint m_locked;
+    // The node we're waiting on, ours once we have released the lock
+    clh_node_t *m_pred;
+};
+
+typedef struct clh_lock clh_t;
+struct clh_lock {
+    alignas(64) clh_node_t *_Atomic m_tail;
+};
+
+/**
+ * Acquire a CLH lock.
+ *
+ * @param p_lock The actual lock.
+ * @param pp_node The calling thread's node.
+ */
+__attribute__((always_inline))
+static inline void
+clh_acquire(clh_t *const p_lock, clh_node_t *const *const pp_node)
+{
+    clh_node_t *const p_node = *pp_node;
+    atomic_store_explicit(&p_node->m_locked, 1, memory_order_relaxed);
+
+    // Release so the thread behind us sees m_locked = 1 before it can find
+    // our node, acquire so we see the predecessor's node initialised.
+    clh_node_t *const pred = atomic_exchange_explicit(&p_lock->m_tail, p_node, memory_order_acq_rel);
+    p_node->m_pred = pred;
+
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        // Spin until the thread ahead of us releases its node.
+        if (!atomic_load_explicit(&pred->m_locked, memory_order_acquire)) {
+            break;
+        }
+#if defined(__arm__) || defined(__aarch64__)
+        wfe();
+#else
+        backoff_wait(&l_bo);
+#endif
+    }
+}
+
+/**
+ * Release a CLH lock.
+ *
+ * @param p_lock The actual lock.
+ * @param pp_node The calling thread's node, replaced with the node it uses
+ * from now on.
+ */
+__attribute__((always_inline))
+static inline void
+clh_release(clh_t *const p_lock, clh_node_t **const pp_node)
+{
+    (void)p_lock;
+    clh_node_t *const p_node = *pp_node;
+    clh_node_t *const pred = p_node->m_pred;
+
+    // Our successor (if any) is spinning on this, after the store the node
+    // belongs to it.
+    atomic_store_explicit(&p_node->m_locked, 0, memory_order_release);
+#if defined(__arm__) || defined(__aarch64__)
+    sev();
+#endif
+
+    *pp_node = pred;
+}
+
+/**
+ * Reset a CLH lock to unlocked.
+ *
+ * @param p_node The node the lock starts out holding on to.
+ */
+static inline void
+clh_reset(clh_t *const p_lock, clh_node_t *const p_node)
+{
+    atomic_store_explicit(&p_node->m_locked, 0, memory_order_relaxed);
+    p_node->m_pred = NULL;
+    atomic_store_explicit(&p_lock->m_tail, p_node, memory_order_relaxed);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+//
+// Compact NUMA-aware lock (CNA)
+//
+// Dice and Kogan's variant of the MCS lock. The lock is still a single mcs_t
+// used as the tail pointer, but when the lock is released the queue is
+// reordered so the next owner is on the same socket (NUMA node) as the
+// releaser when possible. Waiters from other sockets that get skipped are
+// moved to a secondary queue which is handed along with the lock.
+//
+// The secondary queue is put back at the front of the main queue when there
+// are no more local waiters, or after CNA_THRESHOLD consecutive local
+// handoffs so remote waiters aren't starved.
+//
+// The extra state lives in the spare space of mcs_t:
+//
+// m_socket     - the waiter's socket, only looked up when it has to wait
+// m_sec_head   - given to the new owner, the head of the secondary queue
+// m_sec_tail   - in the secondary queue's head node, its tail
+// m_handoffs   - given to the new owner, local handoffs since the secondary
+//                queue was last flushed
+//
+// The uncontended acquire and release are the same as mcs_acquire and
+// mcs_release apart from a couple of extra stores to the caller's own node.
+//
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+#include "mcs.h"
+#include "numa.h"
+
+// Consecutive local handoffs before the secondary queue gets the lock
+#ifndef CNA_THRESHOLD
+#define CNA_THRESHOLD 64u
+#endif
+
+/**
+ * Acquire a CNA lock.
+ *
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node.
+ */
+static inline void
+cna_acquire(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&p_node->m_locked, 1, memory_order_relaxed);
+    p_node->m_socket = -1;
+    p_node->m_handoffs = 0;
+    p_node->m_sec_head = NULL;
+
+    // Same ordering as mcs_acquire
+    mcs_t *const prev_tail = atomic_exchange_explicit(&p_lock->m_next, p_node, memory_order_acq_rel);
+    if (prev_tail != NULL) {
+        // Only a waiter needs to know where it is. Written before we link in
+        // so the releaser sees it.
+        p_node->m_socket = (int)numa_current_node();
+        atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
+
+        LOCK_STATS_CONTENDED();
+        mcs_wait_granted(p_node);
+    }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_MCS);
+}
+
+/**
+ * Find a waiter on our socket and move the remote waiters ahead of it to the
+ * end of the secondary queue.
+ *
+ * Only nodes that are already linked in are looked at, so the tail of the
+ * queue is never moved.
+ *
+ * @return The waiter to hand the lock to, NULL if there isn't a local one
+ */
+static inline mcs_t *
+cna_find_successor(mcs_t *const p_node, mcs_t *const p_next)
+{
+    if (p_node->m_socket < 0) {
+        p_node->m_socket = (int)numa_current_node();
+    }
+    int const socket = p_node->m_socket;
+
+    if (p_next->m_socket == socket) {
+        return p_next;
+    }
+
+    mcs_t *const skip_head = p_next;
+    mcs_t *skip_tail = p_next;
+    mcs_t *cur = atomic_load_explicit(&p_next->m_next, memory_order_acquire);
+    while (cur != NULL) {
+        if (cur->m_socket == socket) {
+            // Cut [skip_head, skip_tail] out and append it to the secondary
+            // queue. None of these nodes is the tail so nobody else will
+            // write to their m_next.
+            atomic_store_explicit(&skip_tail->m_next, NULL, memory_order_relaxed);
+            if (p_node->m_sec_head != NULL) {
+                atomic_store_explicit(&p_node->m_sec_head->m_sec_tail->m_next, skip_head, memory_order_relaxed);
+            } else {
+                p_node->m_sec_head = skip_head;
+            }
+            p_node->m_sec_head->m_sec_tail = skip_tail;
+            return cur;
+        }
+        skip_tail = cur;
+        cur = atomic_load_explicit(&cur->m_next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+/**
+ * Release a CNA lock
+ *
+ * @param p_lock Actual lock
+ * @param p_node Node passed to cna_acquire
+ */
+static inline void
+cna_release(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+    if (l_node == NULL) {
+        mcs_t *const sec_head = p_node->m_sec_head;
+        if (sec_head == NULL) {
+            // Nobody in either queue, same as mcs_release
+            mcs_t *l_exp = p_node;
+            if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_exp, NULL, memory_order_release, memory_order_relaxed)) {
+                return;
+            }
+        } else {
+            // The main queue is empty, the secondary queue becomes the queue
+            mcs_t *l_exp = p_node;
+            if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_exp, sec_head->m_sec_tail, memory_order_release, memory_order_relaxed)) {
+                sec_head->m_sec_head = NULL;
+                sec_head->m_handoffs = 0;
+                atomic_store_explicit(&sec_head->m_locked, 0, memory_order_release);
+                return;
+            }
+        }
+
+        // A new waiter swapped itself in, wait for it to link in.
+        LOCK_STATS_SLOW_RELEASE(LOCK_STATS_MCS);
+        l_node = mcs_wait_next(p_node);
+    }
+
+    mcs_t *succ = NULL;
+    if (p_node->m_handoffs < CNA_THRESHOLD) {
+        succ = cna_find_successor(p_node, l_node);
+    }
+
+    if (succ != NULL) {
+        // Local handoff, the secondary queue goes along with the lock
+        succ->m_sec_head = p_node->m_sec_head;
+        succ->m_handoffs = p_node->m_sec_head != NULL ? p_node->m_handoffs + 1 : 0;
+    } else if (p_node->m_sec_head != NULL) {
+        // Put the secondary queue back in front of the main queue
+        succ = p_node->m_sec_head;
+        atomic_store_explicit(&succ->m_sec_tail->m_next, l_node, memory_order_relaxed);
+        succ->m_sec_head = NULL;
+        succ->m_handoffs = 0;
+    } else {
+        succ = l_node;
+        succ->m_sec_head = NULL;
+        succ->m_handoffs = 0;
+    }
+
+    // Everything written to succ is published by the release
+    atomic_store_explicit(&succ->m_locked, 0, memory_order_release);
+}
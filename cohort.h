@@ -0,0 +1,153 @@
+#pragma once
+
+//
+// NUMA-aware cohort lock (C-TKT-MCS)
+//
+// Dice, Marathe and Shavit's lock cohorting built from the locks in this
+// repo. A ticket lock is the global lock and each NUMA node has its own MCS
+// queue as its local lock.
+//
+// A thread first queues on its node's MCS lock. Once it owns that, it takes
+// the global ticket lock unless the previous owner passed the global lock
+// along with the local one. When releasing, if another thread from the same
+// node is waiting in the local queue it gets both locks directly, so the lock
+// and the data it protects stay on one node. After batch_max consecutive
+// local handoffs the global lock is released so the other nodes get a turn.
+//
+// The local handoff reuses mcs_t's m_locked:
+//
+// COHORT_WAITING      - still waiting for the local lock
+// COHORT_GLOBAL_FREE  - got the local lock, must acquire the global one
+// COHORT_GLOBAL_HELD  - got both locks
+//
+// The owner's node is recorded at acquire time so a thread that migrates
+// while holding the lock still releases the queue it came from.
+//
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+#include "numa.h"
+#include "ticket.h"
+#include "mcs.h"
+
+#define COHORT_WAITING 1
+#define COHORT_GLOBAL_FREE 0
+#define COHORT_GLOBAL_HELD 2
+
+// Local handoffs before the global lock is released
+#define COHORT_DEFAULT_BATCH 64u
+
+typedef struct cohort_lock cohort_t;
+struct cohort_lock {
+    alignas(64) tick_t m_global;
+    // Owned by the lock holder
+    alignas(64) unsigned m_owner_node;
+    unsigned m_batch;
+    unsigned m_batch_max;
+    unsigned m_nnodes;
+    // One MCS lock per node, each on its own cache line
+    mcs_t *m_local;
+};
+
+/**
+ * The NUMA node the calling thread is running on.
+ */
+__attribute__((always_inline))
+static inline unsigned
+cohort_current_node(cohort_t const *const p_lock)
+{
+    if (p_lock->m_nnodes == 1) {
+        return 0;
+    }
+    return numa_current_node() % p_lock->m_nnodes;
+}
+
+/**
+ * Reset a cohort lock to unlocked.
+ *
+ * @param p_local One mcs_t per node
+ * @param nnodes Size of p_local, usually numa_node_count()
+ * @param batch_max Local handoffs allowed before the global lock is released
+ */
+static inline void
+cohort_reset(cohort_t *const p_lock, mcs_t *const p_local, unsigned const nnodes, unsigned const batch_max)
+{
+    p_lock->m_global.total = 0;
+    p_lock->m_owner_node = 0;
+    p_lock->m_batch = 0;
+    p_lock->m_batch_max = batch_max;
+    p_lock->m_nnodes = nnodes;
+    p_lock->m_local = p_local;
+    for (unsigned i = 0; i < nnodes; ++i) {
+        p_local[i] = (mcs_t) {
+            .m_next = NULL,
+            .m_locked = 0,
+        };
+    }
+}
+
+/**
+ * Acquire a cohort lock.
+ *
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node, enqueued on the current node's local lock.
+ */
+static inline void
+cohort_acquire(cohort_t *const p_lock, mcs_t *const p_node)
+{
+    unsigned const node = cohort_current_node(p_lock);
+    mcs_t *const p_local = &p_lock->m_local[node];
+
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&p_node->m_locked, COHORT_WAITING, memory_order_relaxed);
+
+    // Same ordering as mcs_acquire
+    long granted = COHORT_GLOBAL_FREE;
+    mcs_t *const prev_tail = atomic_exchange_explicit(&p_local->m_next, p_node, memory_order_acq_rel);
+    if (prev_tail != NULL) {
+        atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
+
+        backoff_t l_bo = BACKOFF_INIT;
+        for (;;) {
+            granted = atomic_load_explicit(&p_node->m_locked, memory_order_acquire);
+            if (granted != COHORT_WAITING) {
+                break;
+            }
+            backoff_wait(&l_bo);
+        }
+    }
+
+    if (granted != COHORT_GLOBAL_HELD) {
+        ticket_acq(&p_lock->m_global);
+        p_lock->m_batch = 0;
+    }
+    p_lock->m_owner_node = node;
+}
+
+/**
+ * Release a cohort lock
+ *
+ * @param p_lock Actual lock
+ * @param p_node Node passed to cohort_acquire
+ */
+static inline void
+cohort_release(cohort_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_t *const p_local = &p_lock->m_local[p_lock->m_owner_node];
+
+    // Pass both locks to a waiter from our node if there is one linked in and
+    // the batch isn't used up. A waiter that has swapped itself into the tail
+    // but not linked in yet is not worth waiting for.
+    mcs_t *const l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+    if (l_node != NULL && p_lock->m_batch < p_lock->m_batch_max) {
+        p_lock->m_batch++;
+        atomic_store_explicit(&l_node->m_locked, COHORT_GLOBAL_HELD, memory_order_release);
+        return;
+    }
+
+    // Release the global lock first so the next local owner can take it.
+    ticket_rel(&p_lock->m_global);
+    mcs_release(p_local, p_node);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+//
+// Cycle counter access for the benchmarks.
+//
+// On x86 this is the TSC and on ARM it is the virtual counter. Both tick at a
+// constant rate on anything made in the last decade, but not necessarily at
+// the core clock rate, so use cycles_per_sec() to convert to wall time.
+//
+// Everything else falls back to CLOCK_MONOTONIC_RAW in nanoseconds.
+//
+
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_SECOND UINT64_C(1000000000)
+
+static inline uint64_t
+monotonic_raw_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (uint64_t)t.tv_sec * NSEC_PER_SECOND + (uint64_t)t.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((always_inline))
+static inline uint64_t
+cycles_now(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#elif defined(__aarch64__)
+__attribute__((always_inline))
+static inline uint64_t
+cycles_now(void)
+{
+    uint64_t v;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+}
+#else
+__attribute__((always_inline))
+static inline uint64_t
+cycles_now(void)
+{
+    return monotonic_raw_ns();
+}
+#endif
+
+/**
+ * Measure how many cycles_now() ticks there are per second.
+ *
+ * Takes roughly 100ms the first time it is called.
+ */
+static inline uint64_t
+cycles_per_sec(void)
+{
+    static uint64_t s_cps;
+    if (s_cps != 0) {
+        return s_cps;
+    }
+
+#if defined(__aarch64__)
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    s_cps = freq;
+#elif defined(__x86_64__) || defined(__i386__)
+    struct timespec const delay = {
+        .tv_sec = 0,
+        .tv_nsec = 100 * 1000 * 1000,
+    };
+    uint64_t const ns1 = monotonic_raw_ns();
+    uint64_t const cc1 = cycles_now();
+    nanosleep(&delay, NULL);
+    uint64_t const ns2 = monotonic_raw_ns();
+    uint64_t const cc2 = cycles_now();
+    s_cps = (uint64_t)((double)(cc2 - cc1) * NSEC_PER_SECOND / (ns2 - ns1));
+#else
+    s_cps = NSEC_PER_SECOND;
+#endif
+
+    return s_cps;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+//
+// Fairness and handoff locality from acquisition sequence logs
+//
+// Inside the critical section each thread takes the next value of a
+// sequence counter protected by the lock and appends it to its own log.
+// Afterwards the logs are inverted into the order the lock was handed out
+// in, which is all that's needed to work out who got the lock how often and
+// where it went on each handoff.
+//
+// Every thread does the same number of iterations so over a whole run the
+// counts are trivially equal. Only the part of the run before the first
+// thread finishes is looked at, when everyone is still competing.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "topo.h"
+
+typedef enum {
+    HANDOFF_SELF,   // Same thread took the lock again
+    HANDOFF_CORE,   // SMT sibling
+    HANDOFF_LLC,    // Another core sharing the last level cache
+    HANDOFF_NODE,   // Same NUMA node, different LLC
+    HANDOFF_REMOTE, // Different NUMA node
+    HANDOFF_COUNT,
+} handoff_t;
+
+typedef struct {
+    uint64_t window;                    // Acquisitions looked at
+    double jain;                        // 1 is perfectly fair, 1/n is one thread hogging it
+    uint64_t max_starve;                // Most acquisitions by others between two of one thread's
+    uint64_t handoffs[HANDOFF_COUNT];
+} fair_result_t;
+
+static inline handoff_t
+fair_classify(topo_cpu_t const *const from, topo_cpu_t const *const to)
+{
+    if (from == NULL || to == NULL) {
+        return HANDOFF_REMOTE;
+    }
+    if (from->core == to->core) {
+        return HANDOFF_CORE;
+    }
+    if (from->llc == to->llc) {
+        return HANDOFF_LLC;
+    }
+    if (from->node == to->node) {
+        return HANDOFF_NODE;
+    }
+    return HANDOFF_REMOTE;
+}
+
+/**
+ * Analyze the sequence logs of a run.
+ *
+ * @param logs Sequence numbers taken by each thread, in order
+ * @param nthreads Number of threads
+ * @param niter Number of entries in each log
+ * @param cpus The cpu each thread was pinned to
+ * @param p_topo Topology to classify the handoffs with
+ * @param counts Filled with the acquisitions per thread within the window
+ * @return 0 on success, -1 if the logs aren't a valid sequence
+ */
+static inline int
+fair_analyze(uint32_t *const *const logs, long const nthreads, long const niter, int const *const cpus,
+        topo_t const *const p_topo, uint64_t *const counts, fair_result_t *const p_res)
+{
+    uint64_t const total = (uint64_t)nthreads * niter;
+    unsigned *const owner = malloc(total * sizeof(*owner));
+    if (owner == NULL) {
+        return -1;
+    }
+
+    // The window ends when the first thread does its last acquisition
+    uint64_t window = total;
+    for (long t = 0; t < nthreads; ++t) {
+        for (long i = 0; i < niter; ++i) {
+            uint32_t const seq = logs[t][i];
+            if (seq >= total) {
+                free(owner);
+                return -1;
+            }
+            owner[seq] = (unsigned)t;
+        }
+        if ((uint64_t)logs[t][niter - 1] + 1 < window) {
+            window = (uint64_t)logs[t][niter - 1] + 1;
+        }
+    }
+
+    *p_res = (fair_result_t) { .window = window };
+
+    // Index of each thread's last acquisition so far
+    uint64_t *const last = malloc(nthreads * sizeof(*last));
+    if (last == NULL) {
+        free(owner);
+        return -1;
+    }
+    for (long t = 0; t < nthreads; ++t) {
+        counts[t] = 0;
+        last[t] = UINT64_MAX;
+    }
+
+    for (uint64_t seq = 0; seq < window; ++seq) {
+        unsigned const t = owner[seq];
+        // Waiting since the start counts as starving too
+        uint64_t const gap = last[t] == UINT64_MAX ? seq : seq - last[t] - 1;
+        if (gap > p_res->max_starve) {
+            p_res->max_starve = gap;
+        }
+        last[t] = seq;
+        counts[t]++;
+
+        if (seq > 0) {
+            unsigned const prev = owner[seq - 1];
+            if (prev == t) {
+                p_res->handoffs[HANDOFF_SELF]++;
+            } else {
+                p_res->handoffs[fair_classify(topo_get(p_topo, cpus[prev]), topo_get(p_topo, cpus[t]))]++;
+            }
+        }
+    }
+
+    // Threads still waiting at the end of the window are starving too
+    for (long t = 0; t < nthreads; ++t) {
+        uint64_t const gap = last[t] == UINT64_MAX ? window : window - last[t] - 1;
+        if (gap > p_res->max_starve) {
+            p_res->max_starve = gap;
+        }
+    }
+
+    // Jain's index: (sum x)^2 / (n * sum x^2)
+    double sum = 0.0;
+    double sum_sq = 0.0;
+    for (long t = 0; t < nthreads; ++t) {
+        sum += (double)counts[t];
+        sum_sq += (double)counts[t] * counts[t];
+    }
+    p_res->jain = sum_sq > 0.0 ? sum * sum / (nthreads * sum_sq) : 1.0;
+
+    free(last);
+    free(owner);
+    return 0;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+//
+// Flat combining on top of the MCS lock
+//
+// Hendler, Incze, Shavit and Tzafrir's flat combining. Instead of every
+// thread taking the lock and dragging the protected data over to its own
+// cache, a thread posts its critical section to the lock as a function and
+// an argument and waits for it to be run. Whichever thread holds the lock
+// runs everything posted so far before letting go, so the data stays in one
+// cache and only the small records move.
+//
+// Each fc_execute() call posts a record that lives on the caller's stack, so
+// a thread can use any number of locks. The records are pushed on a list in
+// the lock and the combiner takes the whole list at once, runs it in arrival
+// order and marks each record done.
+//
+// A waiter spins on its own record and keeps trying to become the combiner
+// with mcs_trylock(). If nobody has served it after FC_SPIN_TRIES tries it
+// queues on the MCS lock like anyone else, so it can't be starved by a steady
+// stream of threads holding the lock normally.
+//
+// The lock underneath is a plain mcs_lock_t. Code that wants to hold it
+// across more than one call can use fc_lock()/fc_unlock(), which run any
+// posted work on the way out, or even mcs_lock()/mcs_unlock() on m_lock.
+//
+
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+#include "mcs.h"
+
+#define FC_POSTED 1
+#define FC_DONE 2
+
+// Times a waiter tries to become the combiner before queueing on the lock
+#define FC_SPIN_TRIES 1024u
+// Times the combiner goes back for more work before releasing
+#define FC_MAX_PASSES 4u
+
+typedef void *(*fc_fn_t)(void *arg);
+
+typedef struct fc_record fc_record_t;
+
+struct fc_record {
+    alignas(64) atomic_int m_state;
+    fc_fn_t m_fn;
+    void *m_arg;
+    void *m_ret;
+    fc_record_t *m_next;
+};
+
+typedef struct fc_lock fc_t;
+
+struct fc_lock {
+    alignas(64) mcs_lock_t m_lock;
+    // Posted records, newest first
+    alignas(64) fc_record_t *_Atomic m_posted;
+};
+
+#define FC_INITIALIZER { .m_lock = MCS_LOCK_INITIALIZER, .m_posted = NULL }
+
+/**
+ * Run everything posted to the lock. The caller holds m_lock.
+ */
+static inline void
+fc_combine(fc_t *const p_lock)
+{
+    for (unsigned pass = 0; pass < FC_MAX_PASSES; ++pass) {
+        // Acquire pairs with the release in fc_execute so the record is
+        // filled in.
+        fc_record_t *rec = atomic_exchange_explicit(&p_lock->m_posted, NULL, memory_order_acquire);
+        if (rec == NULL) {
+            return;
+        }
+
+        // Reverse the list to run the records in the order they arrived.
+        fc_record_t *l_fifo = NULL;
+        while (rec != NULL) {
+            fc_record_t *const next = rec->m_next;
+            rec->m_next = l_fifo;
+            l_fifo = rec;
+            rec = next;
+        }
+
+        while (l_fifo != NULL) {
+            // The record belongs to its owner again as soon as it's done, so
+            // don't touch it after that.
+            fc_record_t *const next = l_fifo->m_next;
+            l_fifo->m_ret = l_fifo->m_fn(l_fifo->m_arg);
+            atomic_store_explicit(&l_fifo->m_state, FC_DONE, memory_order_release);
+            l_fifo = next;
+        }
+    }
+}
+
+/**
+ * Run fn(arg) under the lock, possibly on another thread.
+ *
+ * @param p_lock The actual lock.
+ * @param fn The critical section.
+ * @param arg Passed to fn.
+ * @return What fn returned.
+ */
+static inline void *
+fc_execute(fc_t *const p_lock, fc_fn_t const fn, void *const arg)
+{
+    fc_record_t rec;
+    atomic_store_explicit(&rec.m_state, FC_POSTED, memory_order_relaxed);
+    rec.m_fn = fn;
+    rec.m_arg = arg;
+    rec.m_ret = NULL;
+
+    // Post the record. Release so the combiner sees it filled in.
+    fc_record_t *head = atomic_load_explicit(&p_lock->m_posted, memory_order_relaxed);
+    do {
+        rec.m_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&p_lock->m_posted, &head, &rec, memory_order_release, memory_order_relaxed));
+
+    backoff_t l_bo = BACKOFF_INIT;
+    for (unsigned i = 0;; ++i) {
+        // Acquire pairs with the combiner's release, for m_ret and whatever
+        // fn wrote.
+        if (atomic_load_explicit(&rec.m_state, memory_order_acquire) == FC_DONE) {
+            return rec.m_ret;
+        }
+
+        if (mcs_trylock(&p_lock->m_lock)) {
+            break;
+        }
+        if (i >= FC_SPIN_TRIES) {
+            mcs_lock(&p_lock->m_lock);
+            break;
+        }
+        backoff_wait(&l_bo);
+    }
+
+    // We hold the lock. Our record was posted before we got it, so either a
+    // previous combiner ran it before releasing or we will now.
+    fc_combine(p_lock);
+    mcs_unlock(&p_lock->m_lock);
+    return rec.m_ret;
+}
+
+/**
+ * Hold the lock directly, e.g. for a critical section that can't be wrapped
+ * in a function.
+ *
+ * @param p_lock The actual lock.
+ */
+static inline void
+fc_lock(fc_t *const p_lock)
+{
+    mcs_lock(&p_lock->m_lock);
+}
+
+/**
+ * Run any posted work and release the lock.
+ *
+ * @param p_lock The actual lock.
+ */
+static inline void
+fc_unlock(fc_t *const p_lock)
+{
+    fc_combine(p_lock);
+    mcs_unlock(&p_lock->m_lock);
+}
+
+static inline void
+fc_reset(fc_t *const p_lock)
+{
+    mcs_lock_reset(&p_lock->m_lock);
+    atomic_store_explicit(&p_lock->m_posted, NULL, memory_order_relaxed);
+}
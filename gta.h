@@ -23,6 +23,7 @@
 #include <stdatomic.h>
 
 #include "backoff.h"
+#include "stats.h"
 
 typedef struct {
     alignas(64) atomic_uintptr_t v;
@@ -35,21 +36,29 @@ struct gta_lock {
     size_t m_allocsz;
 };
 
+/**
+ * Acquire a GTA style lock given its tail and the caller's slot.
+ *
+ * @param p_tail The lock's m_tail.
+ * @param p_slot The caller's slot, which has to stay at the same address for
+ * as long as the lock exists.
+ */
 __attribute__((always_inline))
 static inline void
-gta_acquire(gta_t *const p_lock, unsigned const my_id)
+gta_acquire_slot(atomic_uintptr_t *const p_tail, atomic_uintptr_t *const p_slot)
 {
-    uintptr_t const my_cond = atomic_load_explicit(&p_lock->slots[my_id].v, memory_order_relaxed) & (uintptr_t)0x1;
-    uintptr_t const my_set = (uintptr_t)&p_lock->slots[my_id].v | my_cond;
+    uintptr_t const my_cond = atomic_load_explicit(p_slot, memory_order_relaxed) & (uintptr_t)0x1;
+    uintptr_t const my_set = (uintptr_t)p_slot | my_cond;
 
     // Store the address of our slot and the current cond value in the tail and
     // get the old value.
-    uintptr_t const ahead = atomic_exchange_explicit(&p_lock->m_tail, my_set, memory_order_relaxed);
+    uintptr_t const ahead = atomic_exchange_explicit(p_tail, my_set, memory_order_relaxed);
 
     // Separate the value into the slot pointer and the condition.
     atomic_uintptr_t *const ahead_ptr = (void *)(ahead & ~(uintptr_t)0x1);
     uintptr_t const ahead_cond = ahead & (uintptr_t)0x1;
 
+    backoff_t l_bo = BACKOFF_INIT;
     for (;;) {
         // Spin until the condition value stored in the slot changes.
         uintptr_t const new_cond = atomic_load_explicit(ahead_ptr, memory_order_acquire) & (uintptr_t)0x1;
@@ -57,26 +66,45 @@ gta_acquire(gta_t *const p_lock, unsigned const my_id)
             // The owner has released the lock to us
             break;
         }
+        LOCK_STATS_SPIN();
 #if defined(__arm__) || defined(__aarch64__)
         wfe();
 #else
-        backoff();
+        backoff_wait(&l_bo);
 #endif
     }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_GTA);
 }
 
+/**
+ * Release a GTA style lock given the slot passed to gta_acquire_slot.
+ */
 __attribute__((always_inline))
 static inline void
-gta_release(gta_t *const p_lock, unsigned const my_id)
+gta_release_slot(atomic_uintptr_t *const p_slot)
 {
     // Toggle the condition value stored in our slot.
-    uintptr_t const my_cond = atomic_load_explicit(&p_lock->slots[my_id].v, memory_order_relaxed) & (uintptr_t)0x1;
-    atomic_store_explicit(&p_lock->slots[my_id].v, my_cond ^ (uintptr_t)0x1, memory_order_release);
+    uintptr_t const my_cond = atomic_load_explicit(p_slot, memory_order_relaxed) & (uintptr_t)0x1;
+    atomic_store_explicit(p_slot, my_cond ^ (uintptr_t)0x1, memory_order_release);
 #if defined(__arm__) || defined(__aarch64__)
     sev();
 #endif
 }
 
+__attribute__((always_inline))
+static inline void
+gta_acquire(gta_t *const p_lock, unsigned const my_id)
+{
+    gta_acquire_slot(&p_lock->m_tail, &p_lock->slots[my_id].v);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_release(gta_t *const p_lock, unsigned const my_id)
+{
+    gta_release_slot(&p_lock->slots[my_id].v);
+}
+
 __attribute__((error("There is no try-acquire for the GTA lock")))
 static inline _Bool
 gta_tryacquire(gta_t *const p_lock, unsigned const my_id)
@@ -0,0 +1,214 @@
+#pragma once
+
+//
+// GTA lock with automatic thread IDs
+//
+// The GTA lock in gta.h needs every caller to bring a fixed ID below the
+// number of slots the lock was allocated with. That's awkward when threads
+// come from pools that grow and shrink.
+//
+// Here a thread is given a dense ID the first time it takes any of these
+// locks, kept in thread-local storage, and the ID is recycled when the thread
+// exits. The lowest free ID is handed out first, so they stay below the peak
+// number of threads alive at once.
+//
+// The slots live in chunks of GTA_AUTO_CHUNK_SLOTS that are allocated the
+// first time an ID in them is used on the lock. Waiters hold the address of
+// the slot ahead of them, so slots can never move; instead of reallocating
+// the array the lock has a fixed directory of chunk pointers and a new chunk
+// is published with a single compare and swap. Nobody holding or waiting on
+// the lock is affected.
+//
+// Once a thread's chunk exists, acquiring is the GTA acquire plus a
+// thread-local load and a directory lookup.
+//
+// The registry is a weak symbol so every translation unit that includes this
+// header shares it.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "gta.h"
+
+#define GTA_AUTO_CHUNK_SHIFT 6
+#define GTA_AUTO_CHUNK_SLOTS (1u << GTA_AUTO_CHUNK_SHIFT)
+#define GTA_AUTO_MAX_CHUNKS 64u
+// Slot 0 is the initial tail, thread ID n uses slot n + 1
+#define GTA_AUTO_MAX_THREADS (GTA_AUTO_MAX_CHUNKS * GTA_AUTO_CHUNK_SLOTS - 1)
+
+typedef struct gta_auto_lock gta_auto_t;
+struct gta_auto_lock {
+    alignas(64) atomic_uintptr_t m_tail;
+    alignas(64) gs_t *_Atomic m_chunks[GTA_AUTO_MAX_CHUNKS];
+};
+
+typedef struct {
+    pthread_mutex_t m_mtx;
+    pthread_once_t once;
+    pthread_key_t key;
+    unsigned next_id;
+    unsigned nfree;
+    uint16_t free_id[GTA_AUTO_MAX_THREADS];
+} gta_auto_registry_t;
+
+__attribute__((weak)) gta_auto_registry_t g_gta_auto_registry = {
+    .m_mtx = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+// ID + 1, 0 until the thread first takes a lock
+__attribute__((weak)) _Thread_local unsigned t_gta_auto_id;
+
+static void
+gta_auto_put_id(void *const p)
+{
+    gta_auto_registry_t *const reg = &g_gta_auto_registry;
+    pthread_mutex_lock(&reg->m_mtx);
+    reg->free_id[reg->nfree++] = (uint16_t)((uintptr_t)p - 1);
+    pthread_mutex_unlock(&reg->m_mtx);
+}
+
+static void
+gta_auto_key_init(void)
+{
+    (void)pthread_key_create(&g_gta_auto_registry.key, gta_auto_put_id);
+}
+
+/**
+ * Give the calling thread an ID.
+ */
+__attribute__((noinline))
+static unsigned
+gta_auto_get_id(void)
+{
+    gta_auto_registry_t *const reg = &g_gta_auto_registry;
+    pthread_once(&reg->once, gta_auto_key_init);
+
+    unsigned id = GTA_AUTO_MAX_THREADS;
+    pthread_mutex_lock(&reg->m_mtx);
+    if (reg->nfree > 0) {
+        // Hand back the lowest free ID to keep them dense.
+        unsigned lowest = 0;
+        for (unsigned i = 1; i < reg->nfree; ++i) {
+            if (reg->free_id[i] < reg->free_id[lowest]) {
+                lowest = i;
+            }
+        }
+        id = reg->free_id[lowest];
+        reg->free_id[lowest] = reg->free_id[--reg->nfree];
+    } else if (reg->next_id < GTA_AUTO_MAX_THREADS) {
+        id = reg->next_id++;
+    }
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    if (id == GTA_AUTO_MAX_THREADS) {
+        fprintf(stderr, "More than %u threads using GTA auto locks\n", GTA_AUTO_MAX_THREADS);
+        abort();
+    }
+
+    // Given back when the thread exits. Stored + 1 since NULL means unset.
+    (void)pthread_setspecific(reg->key, (void *)(uintptr_t)(id + 1));
+    t_gta_auto_id = id + 1;
+    return id;
+}
+
+/**
+ * The calling thread's ID, assigned on first use.
+ */
+__attribute__((always_inline))
+static inline unsigned
+gta_auto_thread_id(void)
+{
+    unsigned const id = t_gta_auto_id;
+    return id != 0 ? id - 1 : gta_auto_get_id();
+}
+
+/**
+ * Allocate and publish a chunk of slots, or return the one someone else got
+ * in first with.
+ */
+__attribute__((noinline))
+static gs_t *
+gta_auto_grow(gta_auto_t *const p_lock, unsigned const chunk)
+{
+    size_t const sz = GTA_AUTO_CHUNK_SLOTS * sizeof(gs_t);
+    gs_t *const slots = aligned_alloc(64, sz);
+    if (slots == NULL) {
+        fprintf(stderr, "Failed to allocate GTA slots\n");
+        abort();
+    }
+    memset(slots, 0, sz);
+
+    // Release so whoever finds the chunk sees it zeroed.
+    gs_t *l_exp = NULL;
+    if (atomic_compare_exchange_strong_explicit(&p_lock->m_chunks[chunk], &l_exp, slots, memory_order_acq_rel, memory_order_acquire)) {
+        return slots;
+    }
+    free(slots);
+    return l_exp;
+}
+
+/**
+ * The slot for a thread ID, allocating its chunk if need be.
+ */
+__attribute__((always_inline))
+static inline atomic_uintptr_t *
+gta_auto_slot(gta_auto_t *const p_lock, unsigned const id)
+{
+    unsigned const idx = id + 1;
+    unsigned const chunk = idx >> GTA_AUTO_CHUNK_SHIFT;
+    gs_t *slots = atomic_load_explicit(&p_lock->m_chunks[chunk], memory_order_acquire);
+    if (__builtin_expect(slots == NULL, 0)) {
+        slots = gta_auto_grow(p_lock, chunk);
+    }
+    return &slots[idx & (GTA_AUTO_CHUNK_SLOTS - 1)].v;
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_acquire(gta_auto_t *const p_lock)
+{
+    gta_acquire_slot(&p_lock->m_tail, gta_auto_slot(p_lock, gta_auto_thread_id()));
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_release(gta_auto_t *const p_lock)
+{
+    // The ID is already assigned and its chunk exists, we acquired through it.
+    // t_gta_auto_id is ID + 1, which is the slot index.
+    unsigned const idx = t_gta_auto_id;
+    gs_t *const slots = atomic_load_explicit(&p_lock->m_chunks[idx >> GTA_AUTO_CHUNK_SHIFT], memory_order_relaxed);
+    gta_release_slot(&slots[idx & (GTA_AUTO_CHUNK_SLOTS - 1)].v);
+}
+
+/**
+ * Set up an unlocked lock with the first chunk of slots.
+ */
+static inline void
+gta_auto_init(gta_auto_t *const p_lock)
+{
+    for (unsigned i = 0; i < GTA_AUTO_MAX_CHUNKS; ++i) {
+        atomic_store_explicit(&p_lock->m_chunks[i], NULL, memory_order_relaxed);
+    }
+    gs_t *const slots = gta_auto_grow(p_lock, 0);
+    atomic_store_explicit(&p_lock->m_tail, (uintptr_t)&slots[0].v | (uintptr_t)0x1, memory_order_relaxed);
+}
+
+/**
+ * Free the slots of a lock nobody is using any more.
+ */
+static inline void
+gta_auto_destroy(gta_auto_t *const p_lock)
+{
+    for (unsigned i = 0; i < GTA_AUTO_MAX_CHUNKS; ++i) {
+        free(atomic_load_explicit(&p_lock->m_chunks[i], memory_order_relaxed));
+        atomic_store_explicit(&p_lock->m_chunks[i], NULL, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,556 @@
+//
+// Core to core lock handoff latency matrix.
+//
+// For every pair of cpus, the lock is passed back and forth between a thread
+// pinned on each. The holder waits until the other thread is spinning in
+// acquire, stamps the time into the protected data and releases. The new
+// holder reads the stamp as soon as it gets in, so each sample is the time
+// from release to the waiter entering the critical section.
+//
+// This needs a cycle counter that is synchronized across cpus, which the
+// invariant TSC on x86 and the generic timer on ARM both are.
+//
+// After the matrix for each lock, cpus are grouped into clusters at each
+// point where the sorted latencies jump, which usually lines up with SMT
+// siblings, LLCs and sockets.
+//
+// gcc -O2 -pthread -o handoff handoff.c
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cycles.h"
+#include "naive.h"
+#include "ticket.h"
+#include "mcs.h"
+#include "gta.h"
+
+// Jumps in latency of more than this ratio start a new cluster level
+#define CLUSTER_GAP 1.25
+
+typedef struct {
+    // The lock under test, on its own line(s)
+    union {
+        atomic_uint naive;
+        tick_t ticket;
+        mcs_t mcs;
+        gta_t gta;
+    } lock;
+    // Set by a thread just before it calls acquire, for the naive lock which
+    // has no other way to tell there's a waiter.
+    alignas(64) atomic_uint waiting;
+    // Protected by the lock
+    alignas(64) uint64_t t_rel;
+    unsigned owner;
+    // Set by the first thread to finish so the other doesn't wait forever
+    atomic_bool done;
+    alignas(64) gs_t slots[3];
+} handoff_lock;
+
+typedef struct {
+    handoff_lock *hl;
+    pthread_barrier_t *barrier;
+    int cpu;
+    unsigned id;
+    long rounds;
+    uint64_t *samples;
+    long nsamples;
+    mcs_t node;
+} handoff_arg;
+
+typedef struct {
+    char const *name;
+    void (*init)(handoff_lock *);
+    void (*acq)(handoff_lock *, handoff_arg *);
+    void (*rel)(handoff_lock *, handoff_arg *);
+    bool (*has_waiter)(handoff_lock *, handoff_arg *);
+} primitive;
+
+static void
+naive_init(handoff_lock *const hl)
+{
+    atomic_init(&hl->lock.naive, 0);
+}
+
+static void
+naive_hacq(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    atomic_store(&hl->waiting, 1);
+    acquire(&hl->lock.naive);
+}
+
+static void
+naive_hrel(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    release(&hl->lock.naive);
+}
+
+static bool
+naive_has_waiter(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    return atomic_exchange(&hl->waiting, 0) != 0;
+}
+
+static void
+ticket_init(handoff_lock *const hl)
+{
+    atomic_init(&hl->lock.ticket.total, 0);
+}
+
+static void
+ticket_hacq(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    ticket_acq(&hl->lock.ticket);
+}
+
+static void
+ticket_hrel(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    ticket_rel(&hl->lock.ticket);
+}
+
+static bool
+ticket_has_waiter(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)arg;
+    unsigned const next = atomic_load(&hl->lock.ticket.next_ticket);
+    unsigned const now = atomic_load(&hl->lock.ticket.now_serving);
+    return next - now > 1;
+}
+
+static void
+mcs_init(handoff_lock *const hl)
+{
+    hl->lock.mcs = (mcs_t) {
+        .m_next = NULL,
+        .m_locked = 0
+    };
+}
+
+static void
+mcs_hacq(handoff_lock *const hl, handoff_arg *const arg)
+{
+    mcs_acquire(&hl->lock.mcs, &arg->node);
+}
+
+static void
+mcs_hrel(handoff_lock *const hl, handoff_arg *const arg)
+{
+    mcs_release(&hl->lock.mcs, &arg->node);
+}
+
+static bool
+mcs_has_waiter(handoff_lock *const hl, handoff_arg *const arg)
+{
+    (void)hl;
+    // Wait for the waiter to link itself in so this is a node handoff and not
+    // the false-uncontended release.
+    return atomic_load(&arg->node.m_next) != NULL;
+}
+
+static void
+gta_init(handoff_lock *const hl)
+{
+    memset(hl->slots, 0, sizeof(hl->slots));
+    hl->lock.gta.slots = hl->slots;
+    hl->lock.gta.m_allocsz = sizeof(hl->slots);
+    gta_reset(&hl->lock.gta);
+}
+
+static void
+gta_hacq(handoff_lock *const hl, handoff_arg *const arg)
+{
+    gta_acquire(&hl->lock.gta, arg->id + 1);
+}
+
+static void
+gta_hrel(handoff_lock *const hl, handoff_arg *const arg)
+{
+    gta_release(&hl->lock.gta, arg->id + 1);
+}
+
+static bool
+gta_has_waiter(handoff_lock *const hl, handoff_arg *const arg)
+{
+    // Someone else has swapped themselves into the tail
+    uintptr_t const tail = atomic_load(&hl->lock.gta.m_tail) & ~(uintptr_t)0x1;
+    return tail != (uintptr_t)&hl->slots[arg->id + 1].v;
+}
+
+static primitive const g_prims[] = {
+    { "naive",  naive_init,  naive_hacq,  naive_hrel,  naive_has_waiter },
+    { "ticket", ticket_init, ticket_hacq, ticket_hrel, ticket_has_waiter },
+    { "mcs",    mcs_init,    mcs_hacq,    mcs_hrel,    mcs_has_waiter },
+    { "gta",    gta_init,    gta_hacq,    gta_hrel,    gta_has_waiter },
+};
+
+#define NUM_PRIMS (sizeof(g_prims) / sizeof(g_prims[0]))
+
+static primitive const *g_prim;
+
+static void
+pin_to_cpu(int const cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+        abort();
+    }
+}
+
+static void *
+handoff_routine(void *const varg)
+{
+    handoff_arg *const arg = varg;
+    handoff_lock *const hl = arg->hl;
+    primitive const *const prim = g_prim;
+
+    pin_to_cpu(arg->cpu);
+
+    // Thread 0 starts out holding the lock
+    if (arg->id == 0) {
+        prim->acq(hl, arg);
+        hl->owner = 0;
+        atomic_store(&hl->waiting, 0);
+    }
+
+    pthread_barrier_wait(arg->barrier);
+
+    bool holding = arg->id == 0;
+    for (long r = 0; r < arg->rounds; ++r) {
+        if (!holding) {
+            prim->acq(hl, arg);
+            uint64_t const now = cycles_now();
+            arg->samples[arg->nsamples++] = now - hl->t_rel;
+            hl->owner = arg->id;
+        }
+
+        // Pass the lock on once the other thread is waiting for it
+        while (!prim->has_waiter(hl, arg)) {
+            if (atomic_load_explicit(&hl->done, memory_order_relaxed)) {
+                break;
+            }
+            backoff();
+        }
+        hl->t_rel = cycles_now();
+        prim->rel(hl, arg);
+
+        if (atomic_load_explicit(&hl->done, memory_order_relaxed)) {
+            break;
+        }
+
+        // Don't try to take it back until the other side has it
+        while (*(unsigned volatile *)&hl->owner == arg->id) {
+            backoff();
+        }
+        holding = false;
+    }
+
+    atomic_store(&hl->done, true);
+
+    return NULL;
+}
+
+static int
+cmp_u64(void const *const a, void const *const b)
+{
+    uint64_t const x = *(uint64_t const *)a;
+    uint64_t const y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+median(uint64_t *const samples, long const n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    return samples[n / 2];
+}
+
+/**
+ * Measure the median handoff latency in cycles from cpu a to b and from b
+ * to a.
+ */
+static void
+measure_pair(int const cpu_a, int const cpu_b, long const rounds, uint64_t *const a_to_b, uint64_t *const b_to_a)
+{
+    handoff_lock *const hl = aligned_alloc(64, sizeof(*hl));
+    if (hl == NULL) {
+        fprintf(stderr, "Failed to allocate lock\n");
+        abort();
+    }
+    memset(hl, 0, sizeof(*hl));
+    g_prim->init(hl);
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
+
+    handoff_arg *const args = aligned_alloc(64, 2 * sizeof(*args));
+    uint64_t *const samples = malloc(2 * rounds * sizeof(*samples));
+    if (args == NULL || samples == NULL) {
+        fprintf(stderr, "Failed to allocate samples\n");
+        abort();
+    }
+
+    pthread_t threads[2];
+    for (unsigned i = 0; i < 2; ++i) {
+        memset(&args[i], 0, sizeof(args[i]));
+        args[i].hl = hl;
+        args[i].barrier = &barrier;
+        args[i].cpu = i == 0 ? cpu_a : cpu_b;
+        args[i].id = i;
+        args[i].rounds = rounds;
+        args[i].samples = samples + i * rounds;
+        pthread_create(&threads[i], NULL, handoff_routine, &args[i]);
+    }
+
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    // Each thread's samples are handoffs to it
+    *b_to_a = median(args[0].samples, args[0].nsamples);
+    *a_to_b = median(args[1].samples, args[1].nsamples);
+
+    free(samples);
+    free(args);
+    pthread_barrier_destroy(&barrier);
+    free(hl);
+}
+
+static int
+uf_find(int *const parent, int x)
+{
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+/**
+ * Print the cpus grouped into clusters at each jump in latency.
+ */
+static void
+print_clusters(uint64_t const *const matrix, int const *const cpus, int const ncpus)
+{
+    int const npairs = ncpus * (ncpus - 1) / 2;
+    if (npairs == 0) {
+        return;
+    }
+
+    // A pair's latency is the worse of the two directions
+    uint64_t *const lat = malloc(npairs * sizeof(*lat));
+    int *const parent = malloc(ncpus * sizeof(*parent));
+    if (lat == NULL || parent == NULL) {
+        fprintf(stderr, "Failed to allocate clusters\n");
+        abort();
+    }
+    int k = 0;
+    for (int i = 0; i < ncpus; ++i) {
+        for (int j = i + 1; j < ncpus; ++j) {
+            uint64_t const ab = matrix[i * ncpus + j];
+            uint64_t const ba = matrix[j * ncpus + i];
+            lat[k++] = ab > ba ? ab : ba;
+        }
+    }
+    qsort(lat, npairs, sizeof(*lat), cmp_u64);
+
+    int level = 0;
+    for (int g = 0; g < npairs; ++g) {
+        // Every jump (and the very end) is a threshold for a cluster level
+        bool const last = g == npairs - 1;
+        if (!last && lat[g + 1] <= lat[g] * CLUSTER_GAP) {
+            continue;
+        }
+        if (last) {
+            break;
+        }
+        uint64_t const threshold = lat[g];
+
+        for (int i = 0; i < ncpus; ++i) {
+            parent[i] = i;
+        }
+        for (int i = 0; i < ncpus; ++i) {
+            for (int j = i + 1; j < ncpus; ++j) {
+                uint64_t const ab = matrix[i * ncpus + j];
+                uint64_t const ba = matrix[j * ncpus + i];
+                if ((ab > ba ? ab : ba) <= threshold) {
+                    parent[uf_find(parent, i)] = uf_find(parent, j);
+                }
+            }
+        }
+
+        printf("# level %d (<= %"PRIu64" cycles):", level++, threshold);
+        for (int i = 0; i < ncpus; ++i) {
+            if (uf_find(parent, i) != i) {
+                continue;
+            }
+            printf(" {");
+            bool first = true;
+            for (int j = 0; j < ncpus; ++j) {
+                if (uf_find(parent, j) == i) {
+                    printf(first ? "%d" : ",%d", cpus[j]);
+                    first = false;
+                }
+            }
+            printf("}");
+        }
+        printf("\n");
+    }
+    if (level == 0) {
+        printf("# no latency clusters, all pairs are within %.2fx of each other\n", CLUSTER_GAP);
+    }
+
+    free(parent);
+    free(lat);
+}
+
+static void
+usage(char const *const prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l lock] [-c cpus] [-n rounds]\n"
+            "  -l  lock to measure (default all):", prog);
+    for (size_t i = 0; i < NUM_PRIMS; ++i) {
+        fprintf(stderr, " %s", g_prims[i].name);
+    }
+    fprintf(stderr,
+            "\n"
+            "  -c  comma separated cpus to measure (default all usable cpus)\n"
+            "  -n  handoffs each way per pair (default 1000)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char const *lock_name = "all";
+    char *cpu_list = NULL;
+    long rounds = 1000;
+
+    int c;
+    while ((c = getopt(argc, argv, "l:c:n:h")) != -1) {
+        switch (c) {
+        case 'l':
+            lock_name = optarg;
+            break;
+        case 'c':
+            cpu_list = optarg;
+            break;
+        case 'n':
+            rounds = strtol(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc || rounds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int *const cpus = malloc(CPU_SETSIZE * sizeof(*cpus));
+    if (cpus == NULL) {
+        fprintf(stderr, "Failed to allocate cpus\n");
+        abort();
+    }
+    int ncpus = 0;
+    if (cpu_list != NULL) {
+        for (char *tok = strtok(cpu_list, ","); tok != NULL && ncpus < CPU_SETSIZE; tok = strtok(NULL, ",")) {
+            cpus[ncpus++] = (int)strtol(tok, NULL, 10);
+        }
+    } else {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            fprintf(stderr, "Failed to get the cpu affinity\n");
+            abort();
+        }
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &allowed)) {
+                cpus[ncpus++] = i;
+            }
+        }
+    }
+    if (ncpus < 2) {
+        fprintf(stderr, "Need at least 2 cpus to measure handoffs\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t *const matrix = calloc((size_t)ncpus * ncpus, sizeof(*matrix));
+    if (matrix == NULL) {
+        fprintf(stderr, "Failed to allocate matrix\n");
+        abort();
+    }
+
+    bool found = false;
+    for (size_t p = 0; p < NUM_PRIMS; ++p) {
+        if (strcmp(lock_name, "all") != 0 && strcmp(lock_name, g_prims[p].name) != 0) {
+            continue;
+        }
+        found = true;
+        g_prim = &g_prims[p];
+
+        // Row is the releasing cpu, column the acquiring cpu. Each run
+        // measures both directions of a pair.
+        for (int i = 0; i < ncpus; ++i) {
+            for (int j = i + 1; j < ncpus; ++j) {
+                fprintf(stderr, "%s: cpu %d <-> cpu %d\r", g_prim->name, cpus[i], cpus[j]);
+                measure_pair(cpus[i], cpus[j], rounds, &matrix[i * ncpus + j], &matrix[j * ncpus + i]);
+            }
+        }
+        fprintf(stderr, "\n");
+
+        printf("# %s median handoff latency in cycles\n", g_prim->name);
+        printf("%s", g_prim->name);
+        for (int j = 0; j < ncpus; ++j) {
+            printf(",%d", cpus[j]);
+        }
+        printf("\n");
+        for (int i = 0; i < ncpus; ++i) {
+            printf("%d", cpus[i]);
+            for (int j = 0; j < ncpus; ++j) {
+                if (i == j) {
+                    printf(",");
+                } else {
+                    printf(",%"PRIu64, matrix[i * ncpus + j]);
+                }
+            }
+            printf("\n");
+        }
+        print_clusters(matrix, cpus, ncpus);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (!found) {
+        fprintf(stderr, "Unknown lock %s\n", lock_name);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    free(matrix);
+    free(cpus);
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+//
+// Hemlock
+//
+// Dice and Kogan's queue lock where the lock is a single pointer and the
+// caller doesn't have to supply a node or an ID.
+//
+// Each thread has one thread-local grant word that it uses for every lock it
+// holds. The lock points at the grant word of the last thread to arrive.
+// A thread that finds another thread at the tail spins on that thread's
+// grant word until it contains the address of this lock, then clears it to
+// say it has taken the lock.
+//
+// Releasing with a waiter present stores the lock's address in our grant
+// word and waits for the waiter to clear it, so the grant word is free again
+// before it can be used for another lock.
+//
+// A thread can hold any number of Hemlocks, and the only memory per lock is
+// the pointer itself. Waiters on different locks that happen to queue behind
+// the same thread share its grant word, which is fine because each is only
+// waiting for its own lock's address to show up.
+//
+// The grant word is a weak symbol so every translation unit that includes
+// this header shares it.
+//
+
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+
+typedef struct hemlock hemlock_t;
+
+typedef struct {
+    alignas(64) hemlock_t *_Atomic m_grant;
+} hemlock_grant_t;
+
+struct hemlock {
+    hemlock_grant_t *_Atomic m_tail;
+};
+
+#define HEMLOCK_INITIALIZER { .m_tail = NULL }
+
+__attribute__((weak)) _Thread_local hemlock_grant_t t_hemlock_grant;
+
+/**
+ * Acquire a Hemlock.
+ *
+ * @param p_lock The actual lock.
+ */
+__attribute__((always_inline))
+static inline void
+hemlock_acquire(hemlock_t *const p_lock)
+{
+    hemlock_grant_t *const self = &t_hemlock_grant;
+
+    // acq_rel, the same as the MCS tail exchange
+    hemlock_grant_t *const pred = atomic_exchange_explicit(&p_lock->m_tail, self, memory_order_acq_rel);
+    if (pred != NULL) {
+        // Wait for the thread ahead of us to grant us this lock.
+        backoff_t l_bo = BACKOFF_INIT;
+        for (;;) {
+            if (atomic_load_explicit(&pred->m_grant, memory_order_acquire) == p_lock) {
+                break;
+            }
+            backoff_wait(&l_bo);
+        }
+        // Tell it we have the lock so it can reuse its grant word.
+        atomic_store_explicit(&pred->m_grant, NULL, memory_order_release);
+    }
+}
+
+/**
+ * Release a Hemlock.
+ *
+ * @param p_lock The actual lock.
+ */
+__attribute__((always_inline))
+static inline void
+hemlock_release(hemlock_t *const p_lock)
+{
+    hemlock_grant_t *l_self = &t_hemlock_grant;
+
+    // No waiter, just clear the tail.
+    if (atomic_compare_exchange_strong_explicit(&p_lock->m_tail, &l_self, NULL, memory_order_release, memory_order_relaxed)) {
+        return;
+    }
+
+    hemlock_grant_t *const self = &t_hemlock_grant;
+
+    // Someone is behind us, hand the lock over and wait for it to be taken.
+    atomic_store_explicit(&self->m_grant, p_lock, memory_order_release);
+    for (;;) {
+        if (atomic_load_explicit(&self->m_grant, memory_order_acquire) == NULL) {
+            break;
+        }
+        backoff();
+    }
+}
+
+/**
+ * Try to acquire a Hemlock.
+ *
+ * @return true if the lock was taken
+ */
+__attribute__((always_inline))
+static inline _Bool
+hemlock_tryacquire(hemlock_t *const p_lock)
+{
+    hemlock_grant_t *l_exp = NULL;
+    return atomic_compare_exchange_strong_explicit(&p_lock->m_tail, &l_exp, &t_hemlock_grant, memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void
+hemlock_reset(hemlock_t *const p_lock)
+{
+    atomic_store_explicit(&p_lock->m_tail, NULL, memory_order_relaxed);
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+//
+// Log-bucketed latency histogram
+//
+// Values are bucketed HDR style: the first HIST_SUB values get a bucket each,
+// after that every power of two is split into HIST_SUB linear sub-buckets.
+// With 4 sub-bucket bits any recorded value is off by at most 1/16 (~6%) and
+// the whole 64-bit range fits in under 1000 buckets.
+//
+// Recording is a couple of shifts and an increment so a histogram can sit on
+// the hot path. Give each thread its own histogram and merge them afterwards.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdalign.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist hist_t;
+// Aligned so the size is a multiple of a line, which aligned_alloc(64, ...)
+// requires and keeps each thread's histogram off its neighbours' lines.
+struct hist {
+    alignas(64) uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline void
+hist_reset(hist_t *const p_hist)
+{
+    memset(p_hist, 0, sizeof(*p_hist));
+}
+
+__attribute__((always_inline))
+static inline unsigned
+hist_index(uint64_t const v)
+{
+    if (v < HIST_SUB) {
+        return (unsigned)v;
+    }
+    unsigned const msb = 63 - (unsigned)__builtin_clzll(v);
+    unsigned const shift = msb - HIST_SUB_BITS;
+    // The mantissa includes the leading one so it is in [HIST_SUB, 2*HIST_SUB)
+    unsigned const mantissa = (unsigned)(v >> shift);
+    return (shift + 1) * HIST_SUB + (mantissa - HIST_SUB);
+}
+
+/**
+ * The largest value that lands in bucket idx.
+ */
+static inline uint64_t
+hist_bucket_high(unsigned const idx)
+{
+    if (idx < HIST_SUB) {
+        return idx;
+    }
+    unsigned const shift = idx / HIST_SUB - 1;
+    uint64_t const mantissa = HIST_SUB + idx % HIST_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+__attribute__((always_inline))
+static inline void
+hist_record(hist_t *const p_hist, uint64_t const v)
+{
+    p_hist->buckets[hist_index(v)]++;
+    p_hist->count++;
+    p_hist->sum += v;
+    if (v > p_hist->max) {
+        p_hist->max = v;
+    }
+}
+
+/**
+ * Add the contents of src into dst.
+ */
+static inline void
+hist_merge(hist_t *const dst, hist_t const *const src)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * Get the value at a percentile (0-100).
+ *
+ * The result is the top of the bucket the percentile lands in, so it may
+ * overestimate by up to one bucket width but never by more than the max.
+ */
+static inline uint64_t
+hist_percentile(hist_t const *const p_hist, double const pct)
+{
+    if (p_hist->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(pct / 100.0 * p_hist->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        seen += p_hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t const high = hist_bucket_high(i);
+            return high < p_hist->max ? high : p_hist->max;
+        }
+    }
+
+    return p_hist->max;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+//
+// Lock selection for the benchmark drivers
+//
+// bench and replay both take the locks to run with -l, either "all" or a
+// comma separated list of names, e.g. -l mcs,gta.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Length of the name at the start of p, up to the next comma.
+ */
+static inline size_t
+lock_list_len(char const *const p)
+{
+    return strcspn(p, ",");
+}
+
+/**
+ * Whether the n characters at p are exactly name.
+ */
+static inline bool
+lock_name_eq(char const *const p, size_t const n, char const *const name)
+{
+    return strlen(name) == n && strncmp(p, name, n) == 0;
+}
+
+/**
+ * Whether a lock is in a -l list.
+ */
+static inline bool
+lock_selected(char const *const list, char const *const name)
+{
+    if (strcmp(list, "all") == 0) {
+        return true;
+    }
+    for (char const *p = list;; ++p) {
+        size_t const n = lock_list_len(p);
+        if (lock_name_eq(p, n, name)) {
+            return true;
+        }
+        p += n;
+        if (*p == '\0') {
+            return false;
+        }
+    }
+}
+
+/**
+ * Find the first name in a -l list that isn't one of names.
+ *
+ * @param names nnames lock names
+ * @param p_len Set to the length of the unknown name
+ * @return The unknown name, not terminated, or NULL if every name is known
+ */
+static inline char const *
+lock_list_unknown(char const *const list, char const *const *const names, size_t const nnames, size_t *const p_len)
+{
+    if (strcmp(list, "all") == 0) {
+        return NULL;
+    }
+    for (char const *p = list;; ++p) {
+        size_t const n = lock_list_len(p);
+        bool known = false;
+        for (size_t i = 0; i < nnames; ++i) {
+            known |= lock_name_eq(p, n, names[i]);
+        }
+        if (!known) {
+            *p_len = n;
+            return p;
+        }
+        p += n;
+        if (*p == '\0') {
+            return NULL;
+        }
+    }
+}
@@ -1,10 +1,58 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdalign.h>
 #include <stdatomic.h>
 
 #include "backoff.h"
+#include "stats.h"
+
+/*
+ * Compile time variants
+ * =====================
+ *
+ * MCS_SPIN_WAIT picks how the spin loops (waiting to be granted the lock and
+ * waiting for a successor to link itself in) get acquire semantics:
+ *
+ * MCS_SPIN_FENCE   - relaxed loads, then an acquire fence once the value
+ *                    changes (the default). On weakly ordered machines the
+ *                    loop itself has no barriers.
+ * MCS_SPIN_ACQUIRE - every load in the loop is an acquire load (ldar on ARM).
+ *
+ * MCS_RELEASE picks the algorithm behind mcs_release():
+ *
+ * MCS_RELEASE_CAS  - compare and swap the tail back to NULL (the default)
+ * MCS_RELEASE_XCHG - exchange the tail with NULL and repair the queue if
+ *                    someone got in (also available as mcs_release2())
+ *
+ * e.g. gcc -DMCS_SPIN_WAIT=MCS_SPIN_ACQUIRE -DMCS_RELEASE=MCS_RELEASE_XCHG
+ *
+ * bench_mcs_variants.sh builds and compares every combination.
+ */
+
+#define MCS_SPIN_FENCE 0
+#define MCS_SPIN_ACQUIRE 1
+
+#define MCS_RELEASE_CAS 0
+#define MCS_RELEASE_XCHG 1
+
+#ifndef MCS_SPIN_WAIT
+#define MCS_SPIN_WAIT MCS_SPIN_FENCE
+#endif
+
+#ifndef MCS_RELEASE
+#define MCS_RELEASE MCS_RELEASE_CAS
+#endif
+
+#if MCS_SPIN_WAIT != MCS_SPIN_FENCE && MCS_SPIN_WAIT != MCS_SPIN_ACQUIRE
+#error "MCS_SPIN_WAIT must be MCS_SPIN_FENCE or MCS_SPIN_ACQUIRE"
+#endif
+
+#if MCS_RELEASE != MCS_RELEASE_CAS && MCS_RELEASE != MCS_RELEASE_XCHG
+#error "MCS_RELEASE must be MCS_RELEASE_CAS or MCS_RELEASE_XCHG"
+#endif
 
 /*
  * Common memory ordering explanations
@@ -85,52 +133,135 @@ typedef struct mcs_spinlock_node mcs_t;
 struct mcs_spinlock_node {
     alignas(64) mcs_t *_Atomic m_next;
     long _Atomic m_locked;
+
+    // Only used by the CNA and Malthusian variants (cna.h, mcs_cr.h). They fit
+    // in the node's cache line so plain MCS nodes are no bigger.
+    int m_socket;
+    unsigned m_handoffs;
+    mcs_t *m_sec_head;
+    mcs_t *m_sec_tail;
 };
 
+_Static_assert(sizeof(mcs_t) == 64, "a mcs node should be one cache line");
+
 /**
- * Acquire a mcs lock.
+ * Poll our node once to see if the node ahead of us handed over the lock.
  *
- * @param p_lock The actual lock.
+ * Ensures modifications following the acquire don't get reordered before we
+ * have the lock (release-acquire case).
+ *
+ * @return m_locked, 0 once the lock is ours
+ */
+__attribute__((always_inline))
+static inline long
+mcs_poll_granted(mcs_t *const p_node)
+{
+#if MCS_SPIN_WAIT == MCS_SPIN_ACQUIRE
+    return atomic_load_explicit(&p_node->m_locked, memory_order_acquire);
+#else
+    long const l_locked = atomic_load_explicit(&p_node->m_locked, memory_order_relaxed);
+    if (!l_locked) {
+        atomic_thread_fence(memory_order_acquire);
+    }
+    return l_locked;
+#endif
+}
+
+/**
+ * Spin until the node ahead of us hands over the lock.
+ */
+__attribute__((always_inline))
+static inline void
+mcs_wait_granted(mcs_t *const p_node)
+{
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        if (!mcs_poll_granted(p_node)) {
+            break;
+        }
+        LOCK_STATS_SPIN();
+        backoff_wait(&l_bo);
+    }
+}
+
+/**
+ * Spin until the node behind us has installed itself in our m_next.
+ *
+ * (lock already owned case explanation)
+ *
+ * @return The next node
+ */
+__attribute__((always_inline))
+static inline mcs_t *
+mcs_wait_next(mcs_t *const p_node)
+{
+    for (;;) {
+#if MCS_SPIN_WAIT == MCS_SPIN_ACQUIRE
+        mcs_t *const l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+        if (l_node != NULL) {
+            return l_node;
+        }
+#else
+        mcs_t *const l_node = atomic_load_explicit(&p_node->m_next, memory_order_relaxed);
+        if (l_node != NULL) {
+            atomic_thread_fence(memory_order_acquire);
+            return l_node;
+        }
+#endif
+        backoff();
+    }
+}
+
+/**
+ * Acquire a mcs lock given a pointer to its tail.
+ *
+ * The lock itself is only ever the tail pointer, which lives in the m_next of
+ * an mcs_t lock or the m_tail of an mcs_lock_t.
+ *
+ * @param p_tail The lock's tail.
  * @param p_node Contributed node.
  */
 static inline void
-mcs_acquire(mcs_t *const p_lock, mcs_t *const p_node)
+mcs_acquire_tail(mcs_t *_Atomic *const p_tail, mcs_t *const p_node)
 {
     atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
     atomic_store_explicit(&p_node->m_locked, 1, memory_order_relaxed);
 
     // Place our context at the tail of the queue and get the previous tail.
     // Explanation of ordering above (two acquire case)
-    mcs_t *const prev_tail = atomic_exchange_explicit(&p_lock->m_next, p_node, memory_order_acq_rel);
+    mcs_t *const prev_tail = atomic_exchange_explicit(p_tail, p_node, memory_order_acq_rel);
     if (prev_tail != NULL) {
 
         // Link our node in so the node ahead of us can unlock us.
         // Explanation of order above (lock already owned case)
         atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
 
-        for (;;) {
-            // TODO Is it better to do memory_order_acquire with no thread
-            // fence?
-            long const locked = atomic_load_explicit(&p_node->m_locked, memory_order_relaxed);
-            if (!locked) {
-                // Ensure modifications following the acquire don't get
-                // reordered before we have the lock.
-                atomic_thread_fence(memory_order_acquire);
-                break;
-            }
-            backoff();
-        }
+        LOCK_STATS_CONTENDED();
+        mcs_wait_granted(p_node);
     }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_MCS);
 }
 
 /**
- * Release a mcs lock
+ * Acquire a mcs lock.
  *
- * @param p_lock Actual lock
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node.
+ */
+static inline void
+mcs_acquire(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_acquire_tail(&p_lock->m_next, p_node);
+}
+
+/**
+ * Release a mcs lock by compare and swap, given a pointer to its tail.
+ *
+ * @param p_tail The lock's tail
  * @param p_node Memory that was being spun on
  */
 static inline void
-mcs_release(mcs_t *const p_lock, mcs_t *const p_node)
+mcs_release_cas_tail(mcs_t *_Atomic *const p_tail, mcs_t *const p_node)
 {
     // (lock already owned case explanation)
     mcs_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
@@ -143,23 +274,14 @@ mcs_release(mcs_t *const p_lock, mcs_t *const p_node)
         // acquiring thread does a swap on p_lock->next with acquire so this
         // will work.
         // 2. relaxed - we don't have any writes we need another thread to see
-        if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_node, NULL, memory_order_release, memory_order_relaxed)) {
+        if (atomic_compare_exchange_strong_explicit(p_tail, &l_node, NULL, memory_order_release, memory_order_relaxed)) {
             return;
         }
 
         // If we fail to atomically release the spinlock, we need to spin until
         // the new waiter has installed itself in our m_next ptr.
-        for (;;) {
-
-            // TODO Is it better to do the load with acquire and have no fence?
-            // (lock already owned case explanation)
-            l_node = atomic_load_explicit(&p_node->m_next, memory_order_relaxed);
-            if (l_node != NULL) {
-                atomic_thread_fence(memory_order_acquire);
-                break;
-            }
-            backoff();
-        };
+        LOCK_STATS_SLOW_RELEASE(LOCK_STATS_MCS);
+        l_node = mcs_wait_next(p_node);
     }
 
     // Release the lock to the next waiter
@@ -168,14 +290,26 @@ mcs_release(mcs_t *const p_lock, mcs_t *const p_node)
 }
 
 /**
- * Release a mcs lock, variant 2.
+ * Release a mcs lock by compare and swap
  *
- * @param p_lock
+ * @param p_lock Actual lock
+ * @param p_node Memory that was being spun on
+ */
+static inline void
+mcs_release_cas(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_release_cas_tail(&p_lock->m_next, p_node);
+}
+
+/**
+ * Release a mcs lock, variant 2, given a pointer to its tail.
+ *
+ * @param p_tail
  * @param p_node
  *
  */
 static inline void
-mcs_release2(mcs_t *const p_lock, mcs_t *const p_node)
+mcs_release2_tail(mcs_t *_Atomic *const p_tail, mcs_t *const p_node)
 {
     // (lock already owned case)
     mcs_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
@@ -186,7 +320,7 @@ mcs_release2(mcs_t *const p_lock, mcs_t *const p_node)
         // 2. Must use acquire to create a release -> acquire ordering with
         // old_tail if it isn't us.
         //
-        mcs_t *const old_tail = atomic_exchange_explicit(&p_lock->m_next, NULL, memory_order_acq_rel);
+        mcs_t *const old_tail = atomic_exchange_explicit(p_tail, NULL, memory_order_acq_rel);
         if (old_tail == p_node) {
             // I was really the tail.
             return;
@@ -213,19 +347,11 @@ mcs_release2(mcs_t *const p_lock, mcs_t *const p_node)
         // sees the writes to old_tail (the acquire above is for the same
         // reason).
         //
-        mcs_t *const usurper = atomic_exchange_explicit(&p_lock->m_next, old_tail, memory_order_acq_rel);
-
-        for (;;) {
-            // TODO Is it better to do the load with acquire and have no fence?
-            // Wait for the node after us to install itself in our m_next.
-            // (lock already owned case)
-            l_node = atomic_load_explicit(&p_node->m_next, memory_order_relaxed);
-            if (l_node != NULL) {
-                atomic_thread_fence(memory_order_acquire);
-                break;
-            }
-            backoff();
-        }
+        mcs_t *const usurper = atomic_exchange_explicit(p_tail, old_tail, memory_order_acq_rel);
+
+        // Wait for the node after us to install itself in our m_next.
+        LOCK_STATS_SLOW_RELEASE(LOCK_STATS_MCS);
+        l_node = mcs_wait_next(p_node);
 
         if (usurper != NULL) {
             // writes to l_node are visible to use because of our release ->
@@ -246,3 +372,202 @@ mcs_release2(mcs_t *const p_lock, mcs_t *const p_node)
     }
 }
 
+/**
+ * Release a mcs lock, variant 2.
+ *
+ * @param p_lock
+ * @param p_node
+ *
+ */
+static inline void
+mcs_release2(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_release2_tail(&p_lock->m_next, p_node);
+}
+
+/**
+ * Release a mcs lock using the algorithm picked by MCS_RELEASE, given a
+ * pointer to its tail.
+ *
+ * @param p_tail The lock's tail
+ * @param p_node Memory that was being spun on
+ */
+static inline void
+mcs_release_tail(mcs_t *_Atomic *const p_tail, mcs_t *const p_node)
+{
+#if MCS_RELEASE == MCS_RELEASE_XCHG
+    mcs_release2_tail(p_tail, p_node);
+#else
+    mcs_release_cas_tail(p_tail, p_node);
+#endif
+}
+
+/**
+ * Release a mcs lock using the algorithm picked by MCS_RELEASE
+ *
+ * @param p_lock Actual lock
+ * @param p_node Memory that was being spun on
+ */
+static inline void
+mcs_release(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_release_tail(&p_lock->m_next, p_node);
+}
+
+/*
+ * Nodeless API
+ * ============
+ *
+ * mcs_lock()/mcs_unlock() take an mcs_lock_t, which is just the tail pointer
+ * (8 bytes instead of a padded 64 byte node), and find the node themselves.
+ *
+ * Each thread has a small stack of cache line aligned nodes in thread-local
+ * storage. mcs_lock() takes the lowest free node and records the lock it's
+ * for, and mcs_unlock() looks the lock up in the stack to find its node, so
+ * locks can be released in any order. Up to MCS_NODE_STACK_DEPTH locks can be
+ * held (or waited on) by a thread at once.
+ *
+ * The node stack is a weak symbol so every translation unit that includes
+ * this header shares it.
+ */
+
+#ifndef MCS_NODE_STACK_DEPTH
+#define MCS_NODE_STACK_DEPTH 8u
+#endif
+
+typedef struct mcs_lock_head mcs_lock_t;
+
+struct mcs_lock_head {
+    mcs_t *_Atomic m_tail;
+};
+
+_Static_assert(sizeof(mcs_lock_t) == sizeof(void *), "a mcs lock head should be one pointer");
+
+#define MCS_LOCK_INITIALIZER { .m_tail = NULL }
+
+typedef struct {
+    mcs_t m_nodes[MCS_NODE_STACK_DEPTH];
+    // The lock each node is queued on, NULL when it's free
+    mcs_lock_t *m_locks[MCS_NODE_STACK_DEPTH];
+    // One past the highest node in use
+    unsigned m_depth;
+} mcs_node_stack_t;
+
+__attribute__((weak)) _Thread_local mcs_node_stack_t t_mcs_nodes;
+
+__attribute__((noreturn, noinline, cold))
+static void
+mcs_node_stack_overflow(void)
+{
+    fprintf(stderr, "More than %u mcs locks held by one thread\n", MCS_NODE_STACK_DEPTH);
+    abort();
+}
+
+/**
+ * Find the lowest free node in the calling thread's node stack.
+ *
+ * Locks released out of order leave holes below the top, reusing them keeps
+ * lock coupling (take the next lock, then release the previous one) from
+ * walking off the end of the stack.
+ *
+ * @return Index of the node, at most m_depth
+ */
+__attribute__((always_inline))
+static inline unsigned
+mcs_node_stack_free(mcs_node_stack_t *const stack)
+{
+    unsigned i = 0;
+    while (i < stack->m_depth && stack->m_locks[i] != NULL) {
+        ++i;
+    }
+    if (__builtin_expect(i >= MCS_NODE_STACK_DEPTH, 0)) {
+        mcs_node_stack_overflow();
+    }
+    return i;
+}
+
+/**
+ * Acquire a mcs lock with a node from the calling thread's node stack.
+ *
+ * @param p_lock The actual lock.
+ */
+static inline void
+mcs_lock(mcs_lock_t *const p_lock)
+{
+    mcs_node_stack_t *const stack = &t_mcs_nodes;
+    unsigned const i = mcs_node_stack_free(stack);
+    stack->m_locks[i] = p_lock;
+    if (i == stack->m_depth) {
+        stack->m_depth = i + 1;
+    }
+    mcs_acquire_tail(&p_lock->m_tail, &stack->m_nodes[i]);
+}
+
+/**
+ * Try to acquire a mcs lock with a node from the calling thread's node stack.
+ *
+ * Only succeeds if nobody holds or is waiting on the lock.
+ *
+ * @param p_lock The actual lock.
+ * @return true if the lock was taken, release it with mcs_unlock()
+ */
+static inline _Bool
+mcs_trylock(mcs_lock_t *const p_lock)
+{
+    mcs_node_stack_t *const stack = &t_mcs_nodes;
+    unsigned const i = mcs_node_stack_free(stack);
+
+    // Don't bother writing to the line if it's held
+    if (atomic_load_explicit(&p_lock->m_tail, memory_order_relaxed) != NULL) {
+        return 0;
+    }
+
+    mcs_t *const p_node = &stack->m_nodes[i];
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+
+    // Same ordering as the exchange in mcs_acquire_tail
+    mcs_t *l_exp = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&p_lock->m_tail, &l_exp, p_node, memory_order_acq_rel, memory_order_relaxed)) {
+        return 0;
+    }
+    stack->m_locks[i] = p_lock;
+    if (i == stack->m_depth) {
+        stack->m_depth = i + 1;
+    }
+    return 1;
+}
+
+/**
+ * Release a mcs lock taken with mcs_lock() or mcs_trylock().
+ *
+ * @param p_lock The actual lock.
+ */
+static inline void
+mcs_unlock(mcs_lock_t *const p_lock)
+{
+    mcs_node_stack_t *const stack = &t_mcs_nodes;
+
+    // Nodes are taken lowest first, so look from the bottom. There are only a
+    // handful and this never indexes below the stack.
+    unsigned i = 0;
+    while (stack->m_locks[i] != p_lock) {
+        ++i;
+    }
+    mcs_release_tail(&p_lock->m_tail, &stack->m_nodes[i]);
+
+    // Nobody else looks at the node once it's released. Nodes above it may
+    // still be queued so they can't move, only pop free ones off the top.
+    // Holes below are reused by the next mcs_lock().
+    stack->m_locks[i] = NULL;
+    unsigned depth = stack->m_depth;
+    while (depth > 0 && stack->m_locks[depth - 1] == NULL) {
+        --depth;
+    }
+    stack->m_depth = depth;
+}
+
+static inline void
+mcs_lock_reset(mcs_lock_t *const p_lock)
+{
+    atomic_store_explicit(&p_lock->m_tail, NULL, memory_order_relaxed);
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+//
+// Malthusian MCS lock (MCSCR)
+//
+// Dice's concurrency restricting variant of the MCS lock. Under saturation
+// a plain MCS queue keeps every waiter spinning, each one holding a cpu and
+// a cache line that other work could be using, while only the head of the
+// queue is about to get the lock.
+//
+// Here the releaser culls the surplus. If the waiter it would hand the lock
+// to has someone behind it, that waiter is cut out of the queue and moved to
+// a passive list, and the lock goes to the one behind. One waiter is culled
+// per release, so the active set settles at the owner, its successor and
+// whoever has just arrived.
+//
+// A culled waiter's m_locked is set to 2 and it backs off heavily, yielding
+// its cpu between polls. It's handed the lock directly (m_locked 0) when it
+// comes back:
+//
+// - when the main queue is empty, so the lock is never left idle while
+//   someone is waiting (the passive list is drawn from one at a time), and
+// - after MCS_CR_THRESHOLD handoffs in a row while the passive list is not
+//   empty, so passive waiters rotate back in and aren't starved.
+//
+// Either way the oldest passive waiter goes first.
+//
+// Like the CNA lock the lock is a single mcs_t used as the tail pointer and
+// the passive list lives in the spare space of mcs_t, handed along with the
+// lock:
+//
+// m_sec_head   - given to the new owner, the head of the passive list
+// m_sec_tail   - in the passive list's head node, its tail
+// m_handoffs   - given to the new owner, handoffs since a passive waiter was
+//                last let back in
+//
+// The uncontended acquire and release are the same as mcs_acquire and
+// mcs_release apart from a couple of extra stores to the caller's own node.
+//
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "backoff.h"
+#include "mcs.h"
+
+#define MCS_CR_WAITING 1
+#define MCS_CR_PASSIVE 2
+
+// Handoffs before the oldest passive waiter is let back in
+#ifndef MCS_CR_THRESHOLD
+#define MCS_CR_THRESHOLD 256u
+#endif
+
+/**
+ * Spin until the lock is handed to us, backing off heavily while passive.
+ */
+__attribute__((always_inline))
+static inline void
+mcs_cr_wait_granted(mcs_t *const p_node)
+{
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        // Same load and ordering as mcs_wait_granted
+        long const l_state = mcs_poll_granted(p_node);
+        if (l_state == 0) {
+            break;
+        }
+        LOCK_STATS_SPIN();
+        if (l_state == MCS_CR_PASSIVE) {
+            sched_yield();
+        } else {
+            backoff_wait(&l_bo);
+        }
+    }
+}
+
+/**
+ * Acquire a Malthusian MCS lock.
+ *
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node.
+ */
+static inline void
+mcs_cr_acquire(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&p_node->m_locked, MCS_CR_WAITING, memory_order_relaxed);
+    p_node->m_handoffs = 0;
+    p_node->m_sec_head = NULL;
+
+    // Same ordering as mcs_acquire
+    mcs_t *const prev_tail = atomic_exchange_explicit(&p_lock->m_next, p_node, memory_order_acq_rel);
+    if (prev_tail != NULL) {
+        atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
+
+        LOCK_STATS_CONTENDED();
+        mcs_cr_wait_granted(p_node);
+    }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_MCS);
+}
+
+/**
+ * Take the oldest waiter off the passive list.
+ *
+ * @param p_node The owner's node, holding the passive list.
+ * @return The waiter, its m_sec_head is the rest of the list
+ */
+static inline mcs_t *
+mcs_cr_pop_passive(mcs_t *const p_node)
+{
+    mcs_t *const head = p_node->m_sec_head;
+    mcs_t *const rest = atomic_load_explicit(&head->m_next, memory_order_relaxed);
+    if (rest != NULL) {
+        rest->m_sec_tail = head->m_sec_tail;
+    }
+    head->m_sec_head = rest;
+    return head;
+}
+
+/**
+ * Release a Malthusian MCS lock
+ *
+ * @param p_lock Actual lock
+ * @param p_node Node passed to mcs_cr_acquire
+ */
+static inline void
+mcs_cr_release(mcs_t *const p_lock, mcs_t *const p_node)
+{
+    mcs_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+    if (l_node == NULL) {
+        mcs_t *const sec_head = p_node->m_sec_head;
+        if (sec_head == NULL) {
+            // Nobody active or passive, same as mcs_release
+            mcs_t *l_exp = p_node;
+            if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_exp, NULL, memory_order_release, memory_order_relaxed)) {
+                return;
+            }
+        } else {
+            // Nobody active, the oldest passive waiter becomes the queue. It
+            // isn't in the main queue so nobody else writes its m_next.
+            mcs_t *const rest = atomic_load_explicit(&sec_head->m_next, memory_order_relaxed);
+            atomic_store_explicit(&sec_head->m_next, NULL, memory_order_relaxed);
+            mcs_t *l_exp = p_node;
+            if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_exp, sec_head, memory_order_release, memory_order_relaxed)) {
+                if (rest != NULL) {
+                    rest->m_sec_tail = sec_head->m_sec_tail;
+                }
+                sec_head->m_sec_head = rest;
+                sec_head->m_handoffs = 0;
+                atomic_store_explicit(&sec_head->m_locked, 0, memory_order_release);
+                return;
+            }
+            atomic_store_explicit(&sec_head->m_next, rest, memory_order_relaxed);
+        }
+
+        // A new waiter swapped itself in, wait for it to link in.
+        LOCK_STATS_SLOW_RELEASE(LOCK_STATS_MCS);
+        l_node = mcs_wait_next(p_node);
+    }
+
+    mcs_t *succ;
+    if (p_node->m_sec_head != NULL && p_node->m_handoffs >= MCS_CR_THRESHOLD) {
+        // Let the oldest passive waiter back in ahead of the queue
+        succ = mcs_cr_pop_passive(p_node);
+        atomic_store_explicit(&succ->m_next, l_node, memory_order_relaxed);
+        succ->m_handoffs = 0;
+    } else {
+        mcs_t *const l_after = atomic_load_explicit(&l_node->m_next, memory_order_acquire);
+        if (l_after != NULL) {
+            // Surplus waiter. Cut l_node out and append it to the passive
+            // list. It isn't the tail so nobody else writes its m_next.
+            atomic_store_explicit(&l_node->m_next, NULL, memory_order_relaxed);
+            if (p_node->m_sec_head != NULL) {
+                atomic_store_explicit(&p_node->m_sec_head->m_sec_tail->m_next, l_node, memory_order_relaxed);
+            } else {
+                p_node->m_sec_head = l_node;
+            }
+            p_node->m_sec_head->m_sec_tail = l_node;
+            atomic_store_explicit(&l_node->m_locked, MCS_CR_PASSIVE, memory_order_relaxed);
+            succ = l_after;
+        } else {
+            succ = l_node;
+        }
+        succ->m_sec_head = p_node->m_sec_head;
+        succ->m_handoffs = p_node->m_sec_head != NULL ? p_node->m_handoffs + 1 : 0;
+    }
+
+    // Everything written to succ is published by the release
+    atomic_store_explicit(&succ->m_locked, 0, memory_order_release);
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+//
+// Spin-then-park MCS lock for Linux
+//
+// The MCS lock from mcs.h assumes every waiter has a cpu to itself. When
+// there are more threads than cpus a waiter can be spinning on a cpu that the
+// thread ahead of it needs to run, and the whole queue crawls along one
+// timeslice at a time.
+//
+// Here a waiter spins on its node for a while and then goes to sleep on it
+// with FUTEX_WAIT. The node's state says whether the waiter is asleep, so the
+// releaser only makes the FUTEX_WAKE system call when it has to. Acquiring
+// and releasing without contention, or with a waiter that is still
+// spinning, doesn't make any system calls.
+//
+// How long to spin adapts per node: a waiter that was handed the lock while
+// spinning spins twice as long next time, one that had to park spins half as
+// long. Keep the node around between acquisitions (e.g. one per thread) to
+// get the benefit.
+//
+// The queue is the same as mcs.h, see there for the memory ordering.
+//
+
+#include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "backoff.h"
+
+#define MCS_PARK_GRANTED 0
+#define MCS_PARK_WAITING 1
+#define MCS_PARK_PARKED 2
+
+// Spin iterations before parking, the budget stays within these
+#define MCS_PARK_SPIN_MIN 64u
+#define MCS_PARK_SPIN_DEFAULT 1024u
+#define MCS_PARK_SPIN_MAX 65536u
+
+typedef struct mcs_park_node mcs_park_t;
+
+struct mcs_park_node {
+    alignas(64) mcs_park_t *_Atomic m_next;
+    // futex word
+    atomic_int m_state;
+    // Spins before parking, 0 for the default
+    unsigned m_budget;
+};
+
+#define MCS_PARK_INITIALIZER { .m_next = NULL, .m_state = MCS_PARK_GRANTED, .m_budget = 0 }
+
+static inline void
+mcs_park_futex_wait(atomic_int *const p_word, int const val)
+{
+    (void)syscall(SYS_futex, p_word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void
+mcs_park_futex_wake(atomic_int *const p_word)
+{
+    (void)syscall(SYS_futex, p_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Wait to be handed the lock, spinning then parking.
+ */
+__attribute__((noinline))
+static void
+mcs_park_wait(mcs_park_t *const p_node)
+{
+    unsigned budget = p_node->m_budget != 0 ? p_node->m_budget : MCS_PARK_SPIN_DEFAULT;
+
+    for (unsigned i = 0; i < budget; ++i) {
+        if (atomic_load_explicit(&p_node->m_state, memory_order_acquire) == MCS_PARK_GRANTED) {
+            budget *= 2;
+            p_node->m_budget = budget < MCS_PARK_SPIN_MAX ? budget : MCS_PARK_SPIN_MAX;
+            return;
+        }
+        backoff();
+    }
+
+    budget /= 2;
+    p_node->m_budget = budget > MCS_PARK_SPIN_MIN ? budget : MCS_PARK_SPIN_MIN;
+
+    // Tell the releaser we're going to sleep. If the CAS fails we've just been
+    // handed the lock.
+    int l_exp = MCS_PARK_WAITING;
+    if (!atomic_compare_exchange_strong_explicit(&p_node->m_state, &l_exp, MCS_PARK_PARKED, memory_order_acquire, memory_order_acquire)) {
+        return;
+    }
+
+    // FUTEX_WAIT returns straight away if the state is no longer PARKED, and
+    // can wake up spuriously.
+    while (atomic_load_explicit(&p_node->m_state, memory_order_acquire) != MCS_PARK_GRANTED) {
+        mcs_park_futex_wait(&p_node->m_state, MCS_PARK_PARKED);
+    }
+}
+
+/**
+ * Acquire a spin-then-park mcs lock.
+ *
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node.
+ */
+static inline void
+mcs_park_acquire(mcs_park_t *const p_lock, mcs_park_t *const p_node)
+{
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&p_node->m_state, MCS_PARK_WAITING, memory_order_relaxed);
+
+    mcs_park_t *const prev_tail = atomic_exchange_explicit(&p_lock->m_next, p_node, memory_order_acq_rel);
+    if (prev_tail != NULL) {
+        atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
+        mcs_park_wait(p_node);
+    }
+}
+
+/**
+ * Release a spin-then-park mcs lock
+ *
+ * @param p_lock Actual lock
+ * @param p_node Node passed to mcs_park_acquire
+ */
+static inline void
+mcs_park_release(mcs_park_t *const p_lock, mcs_park_t *const p_node)
+{
+    mcs_park_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+    if (l_node == NULL) {
+        l_node = p_node;
+        if (atomic_compare_exchange_strong_explicit(&p_lock->m_next, &l_node, NULL, memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+
+        // The new waiter is between swapping itself in and linking in. It
+        // could have been preempted there, so don't spin forever.
+        for (unsigned i = 0;; ++i) {
+            l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+            if (l_node != NULL) {
+                break;
+            }
+            if (i < MCS_PARK_SPIN_MIN) {
+                backoff();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    // Only wake the waiter up if it went to sleep. The node may be reused as
+    // soon as the exchange is done, a wake on a reused node is spurious at
+    // worst.
+    if (atomic_exchange_explicit(&l_node->m_state, MCS_PARK_GRANTED, memory_order_release) == MCS_PARK_PARKED) {
+        mcs_park_futex_wake(&l_node->m_state);
+    }
+}
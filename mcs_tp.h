@@ -0,0 +1,174 @@
+#pragma once
+
+//
+// Time-published MCS lock
+//
+// He, Scherer and Scott's preemption tolerant variant of the MCS lock. In a
+// FIFO queue a waiter that has been preempted holds up everyone behind it
+// once the lock gets to it. When there are more threads than cpus that
+// happens all the time and throughput collapses.
+//
+// Here every waiter publishes a timestamp in its node while it spins. When
+// releasing, the owner looks at the time of the next waiter, and if it hasn't
+// been updated for longer than the lock's patience the waiter is assumed to
+// be preempted. It is marked as removed and skipped, and the owner moves on
+// to the waiter behind it. A removed waiter notices when it runs again and
+// queues up again at the tail.
+//
+// The last waiter in the queue is never skipped, removing it would mean
+// racing new arrivals for the tail.
+//
+// A waiter that has been waiting for longer than the patience itself yields
+// its cpu between checks, since whoever it's waiting on probably needs it.
+//
+// When every thread has a cpu nobody goes stale and it is the MCS lock. See
+// mcs.h for the memory ordering of the queue itself.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "backoff.h"
+#include "cycles.h"
+
+#define MCS_TP_WAITING 1
+#define MCS_TP_GRANTED 0
+#define MCS_TP_REMOVED 2
+
+// How long a waiter can go without publishing before it's skipped
+#define MCS_TP_PATIENCE_NS UINT64_C(50000)
+
+// Spin iterations between timestamps
+#define MCS_TP_PUBLISH_SPINS 32u
+
+typedef struct mcs_tp_node mcs_tp_node_t;
+
+struct mcs_tp_node {
+    alignas(64) mcs_tp_node_t *_Atomic m_next;
+    atomic_int m_state;
+    // cycles_now() when the waiter last checked in
+    _Atomic uint64_t m_time;
+};
+
+typedef struct mcs_tp_lock mcs_tp_t;
+
+struct mcs_tp_lock {
+    alignas(64) mcs_tp_node_t *_Atomic m_tail;
+    uint64_t m_patience;
+};
+
+/**
+ * Reset a time-published MCS lock to unlocked.
+ *
+ * The first call measures cycles_per_sec() which takes a while on x86.
+ *
+ * @param patience_ns How long a waiter can go without publishing its time
+ * before it's skipped, e.g. MCS_TP_PATIENCE_NS
+ */
+static inline void
+mcs_tp_reset(mcs_tp_t *const p_lock, uint64_t const patience_ns)
+{
+    atomic_store_explicit(&p_lock->m_tail, NULL, memory_order_relaxed);
+    p_lock->m_patience = (uint64_t)((double)patience_ns * cycles_per_sec() / NSEC_PER_SECOND);
+}
+
+/**
+ * Acquire a time-published mcs lock.
+ *
+ * @param p_lock The actual lock.
+ * @param p_node Contributed node.
+ */
+static inline void
+mcs_tp_acquire(mcs_tp_t *const p_lock, mcs_tp_node_t *const p_node)
+{
+    for (;;) {
+        atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+        atomic_store_explicit(&p_node->m_state, MCS_TP_WAITING, memory_order_relaxed);
+        atomic_store_explicit(&p_node->m_time, cycles_now(), memory_order_relaxed);
+
+        // Same ordering as mcs_acquire
+        mcs_tp_node_t *const prev_tail = atomic_exchange_explicit(&p_lock->m_tail, p_node, memory_order_acq_rel);
+        if (prev_tail == NULL) {
+            return;
+        }
+        atomic_store_explicit(&prev_tail->m_next, p_node, memory_order_release);
+
+        uint64_t const start = atomic_load_explicit(&p_node->m_time, memory_order_relaxed);
+        backoff_t l_bo = BACKOFF_INIT;
+        int state;
+        for (unsigned i = 1;; ++i) {
+            state = atomic_load_explicit(&p_node->m_state, memory_order_acquire);
+            if (state != MCS_TP_WAITING) {
+                break;
+            }
+            if (i % MCS_TP_PUBLISH_SPINS == 0) {
+                uint64_t const now = cycles_now();
+                atomic_store_explicit(&p_node->m_time, now, memory_order_relaxed);
+                // Waiting longer than the patience means someone ahead of us
+                // isn't running, give them our cpu.
+                if (now - start > p_lock->m_patience) {
+                    sched_yield();
+                    continue;
+                }
+            }
+            backoff_wait(&l_bo);
+        }
+
+        if (state == MCS_TP_GRANTED) {
+            return;
+        }
+        // We were skipped, the releaser is done with our node so queue again.
+    }
+}
+
+/**
+ * Release a time-published mcs lock
+ *
+ * @param p_lock Actual lock
+ * @param p_node Node passed to mcs_tp_acquire
+ */
+static inline void
+mcs_tp_release(mcs_tp_t *const p_lock, mcs_tp_node_t *const p_node)
+{
+    mcs_tp_node_t *l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+    if (l_node == NULL) {
+        l_node = p_node;
+        if (atomic_compare_exchange_strong_explicit(&p_lock->m_tail, &l_node, NULL, memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+
+        // The new waiter is between swapping itself in and linking in. It
+        // could have been preempted there, so don't spin forever.
+        for (unsigned i = 0;; ++i) {
+            l_node = atomic_load_explicit(&p_node->m_next, memory_order_acquire);
+            if (l_node != NULL) {
+                break;
+            }
+            if (i < MCS_TP_PUBLISH_SPINS) {
+                backoff();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    for (;;) {
+        uint64_t const published = atomic_load_explicit(&l_node->m_time, memory_order_relaxed);
+        mcs_tp_node_t *const next = atomic_load_explicit(&l_node->m_next, memory_order_acquire);
+
+        // Hand over to a waiter that's still running, or to the last one we
+        // can see whatever state it's in.
+        if (next == NULL || cycles_now() - published <= p_lock->m_patience) {
+            atomic_store_explicit(&l_node->m_state, MCS_TP_GRANTED, memory_order_release);
+            return;
+        }
+
+        // Skip it. Once it's marked the waiter can reuse the node, so we're
+        // done with it.
+        atomic_store_explicit(&l_node->m_state, MCS_TP_REMOVED, memory_order_release);
+        l_node = next;
+    }
+}
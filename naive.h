@@ -4,18 +4,22 @@
 #include <stdatomic.h>
 
 #include "backoff.h"
+#include "stats.h"
 
 __attribute__((always_inline))
 static inline void
 acquire(atomic_uint *const lock)
 {
+    backoff_t l_bo = BACKOFF_INIT;
     for (;;) {
         unsigned const v = atomic_fetch_or_explicit(lock, 1, memory_order_acquire);
         if (v == 0) {
             break;
         }
-        backoff();
+        LOCK_STATS_SPIN();
+        backoff_wait(&l_bo);
     }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_NAIVE);
 }
 
 __attribute__((always_inline))
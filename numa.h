@@ -0,0 +1,58 @@
+#pragma once
+
+//
+// NUMA node detection for the NUMA-aware locks
+//
+
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+/**
+ * Number of NUMA nodes in the system, 1 if it can't be determined.
+ */
+static inline unsigned
+numa_node_count(void)
+{
+    FILE *const f = fopen("/sys/devices/system/node/possible", "r");
+    if (f == NULL) {
+        return 1;
+    }
+    // A list such as "0" or "0-3", the last number is the highest node.
+    unsigned nnodes = 1;
+    unsigned lo;
+    unsigned hi;
+    int const n = fscanf(f, "%u-%u", &lo, &hi);
+    if (n == 2) {
+        nnodes = hi + 1;
+    } else if (n == 1) {
+        nnodes = lo + 1;
+    }
+    fclose(f);
+    return nnodes;
+}
+
+/**
+ * The NUMA node the calling thread is running on, 0 if it can't be
+ * determined.
+ */
+__attribute__((always_inline))
+static inline unsigned
+numa_current_node(void)
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+#if defined(_GNU_SOURCE) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    // Goes through the vDSO instead of a real system call
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+#else
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+#endif
+    return node;
+}
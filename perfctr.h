@@ -0,0 +1,194 @@
+#pragma once
+
+//
+// Per-thread hardware performance counters using perf_event_open
+//
+// Spinlock cost is mostly coherence traffic so timing alone doesn't say why
+// one lock beats another. The counters here are opened as a single group for
+// the calling thread so they are all scheduled onto the PMU together, and
+// only count user space.
+//
+// Any counter the CPU, kernel or container doesn't allow is left out of the
+// group. If none can be opened everything is reported as unavailable and the
+// benchmark carries on without them.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+typedef enum {
+    PMU_CYCLES,
+    PMU_INSTRUCTIONS,
+    PMU_LLC_MISSES,
+    PMU_NODE_MISSES,    // Loads that missed the local NUMA node
+    PMU_RAW,            // CPU specific, e.g. a remote HITM event
+    PMU_COUNT,
+} pmu_event_t;
+
+static char const *const g_pmu_names[PMU_COUNT] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "node_misses",
+    "raw",
+};
+
+typedef struct {
+    int leader;
+    int fds[PMU_COUNT];
+    // Events in the order they were added to the group
+    pmu_event_t order[PMU_COUNT];
+    unsigned nopen;
+} pmu_group_t;
+
+typedef struct {
+    bool valid[PMU_COUNT];
+    uint64_t values[PMU_COUNT];
+} pmu_counts_t;
+
+static inline int
+pmu_open_one(struct perf_event_attr *const attr, int const group_fd)
+{
+    attr->size = sizeof(*attr);
+    attr->disabled = group_fd == -1;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+/**
+ * Open the counters for the calling thread.
+ *
+ * @param raw_config Raw event config for PMU_RAW, 0 to leave it out
+ * @return The number of counters opened, 0 if there is no PMU access
+ */
+static inline unsigned
+pmu_open(pmu_group_t *const p_grp, uint64_t const raw_config)
+{
+    p_grp->leader = -1;
+    p_grp->nopen = 0;
+
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        switch ((pmu_event_t)e) {
+        case PMU_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PMU_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PMU_LLC_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PMU_NODE_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_NODE
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PMU_RAW:
+            if (raw_config == 0) {
+                p_grp->fds[e] = -1;
+                continue;
+            }
+            attr.type = PERF_TYPE_RAW;
+            attr.config = raw_config;
+            break;
+        default:
+            break;
+        }
+
+        int const fd = pmu_open_one(&attr, p_grp->leader);
+        p_grp->fds[e] = fd;
+        if (fd < 0) {
+            continue;
+        }
+        if (p_grp->leader < 0) {
+            p_grp->leader = fd;
+        }
+        p_grp->order[p_grp->nopen++] = (pmu_event_t)e;
+    }
+
+    return p_grp->nopen;
+}
+
+static inline void
+pmu_start(pmu_group_t const *const p_grp)
+{
+    if (p_grp->leader >= 0) {
+        ioctl(p_grp->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(p_grp->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static inline void
+pmu_stop(pmu_group_t const *const p_grp)
+{
+    if (p_grp->leader >= 0) {
+        ioctl(p_grp->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+/**
+ * Read the counters, scaled up if the group was multiplexed off the PMU.
+ */
+static inline void
+pmu_read(pmu_group_t const *const p_grp, pmu_counts_t *const p_counts)
+{
+    memset(p_counts, 0, sizeof(*p_counts));
+    if (p_grp->leader < 0) {
+        return;
+    }
+
+    // nr, time_enabled, time_running then one value per counter
+    uint64_t buf[3 + PMU_COUNT];
+    ssize_t const n = read(p_grp->leader, buf, sizeof(buf));
+    if (n < (ssize_t)(3 * sizeof(uint64_t)) || buf[0] != p_grp->nopen) {
+        return;
+    }
+
+    double const scale = buf[2] != 0 ? (double)buf[1] / buf[2] : 0.0;
+    for (unsigned i = 0; i < p_grp->nopen; ++i) {
+        pmu_event_t const e = p_grp->order[i];
+        p_counts->valid[e] = buf[2] != 0;
+        p_counts->values[e] = (uint64_t)(buf[3 + i] * scale);
+    }
+}
+
+static inline void
+pmu_close(pmu_group_t *const p_grp)
+{
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        if (p_grp->fds[e] >= 0) {
+            close(p_grp->fds[e]);
+            p_grp->fds[e] = -1;
+        }
+    }
+    p_grp->leader = -1;
+    p_grp->nopen = 0;
+}
+
+/**
+ * Add the counts of src into dst. A counter is only valid if it was valid in
+ * both, i.e. every thread managed to count it.
+ */
+static inline void
+pmu_merge(pmu_counts_t *const dst, pmu_counts_t const *const src)
+{
+    for (int e = 0; e < PMU_COUNT; ++e) {
+        dst->valid[e] = dst->valid[e] && src->valid[e];
+        dst->values[e] += src->values[e];
+    }
+}
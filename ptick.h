@@ -0,0 +1,112 @@
+#pragma once
+
+//
+// Partitioned ticket lock
+//
+// Dice's partitioned ticket lock. Like the ticket lock there is one
+// next_ticket counter handing out places in line, but instead of a single
+// now_serving word that everybody spins on, the grants are spread over
+// PTICK_SLOTS padded slots. A waiter with ticket t spins on slot
+// t % PTICK_SLOTS until it holds t, and the owner of ticket t - 1 is the only
+// thread that writes to it.
+//
+// So with up to PTICK_SLOTS threads waiting each one spins on its own line,
+// and new arrivals taking a ticket don't disturb anyone. Past that waiters
+// start sharing slots, which is still no worse than the ticket lock.
+//
+// The lock is FIFO like the ticket lock and doesn't need queue nodes or
+// thread IDs, at the cost of PTICK_SLOTS lines per lock.
+//
+
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "backoff.h"
+
+#ifndef PTICK_SLOTS
+#define PTICK_SLOTS 8u
+#endif
+
+_Static_assert(PTICK_SLOTS != 0 && (PTICK_SLOTS & (PTICK_SLOTS - 1)) == 0, "the slot count has to be a power of 2 so tickets wrap cleanly");
+
+typedef struct {
+    alignas(64) atomic_uint m_grant;
+} ptick_slot_t;
+
+typedef struct partitioned_ticket_spinlock ptick_t;
+
+struct partitioned_ticket_spinlock {
+    alignas(64) atomic_uint m_next_ticket;
+    // The owner's ticket, only touched by the owner
+    alignas(64) unsigned m_owner;
+    ptick_slot_t m_slots[PTICK_SLOTS];
+};
+
+static inline void
+ptick_acq(ptick_t *const p_lock)
+{
+    unsigned const my_ticket = atomic_fetch_add_explicit(&p_lock->m_next_ticket, 1, memory_order_relaxed);
+    atomic_uint *const grant = &p_lock->m_slots[my_ticket % PTICK_SLOTS].m_grant;
+
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        unsigned const granted = atomic_load_explicit(grant, memory_order_acquire);
+        if (granted == my_ticket) {
+            break;
+        }
+#if defined(__arm__) || defined(__aarch64__)
+        wfe();
+#else
+        // The owner holds a ticket between granted and granted +
+        // PTICK_SLOTS - 1, so this is at most PTICK_SLOTS - 1 more than the
+        // real distance.
+        backoff_wait_dist(&l_bo, my_ticket - granted);
+#endif
+    }
+    p_lock->m_owner = my_ticket;
+}
+
+static inline void
+ptick_rel(ptick_t *const p_lock)
+{
+    unsigned const next = p_lock->m_owner + 1;
+    atomic_store_explicit(&p_lock->m_slots[next % PTICK_SLOTS].m_grant, next, memory_order_release);
+#if defined(__arm__) || defined(__aarch64__)
+    sev();
+#endif
+}
+
+/**
+ * Take the lock if it's free and nobody is waiting, like ticket_tryacq.
+ *
+ * @return true if the lock was taken
+ */
+static inline bool
+ptick_tryacq(ptick_t *const p_lock)
+{
+    unsigned next = atomic_load_explicit(&p_lock->m_next_ticket, memory_order_relaxed);
+
+    // The next ticket has already been granted, so the lock is free. Nobody
+    // else can change the grant without first taking that ticket.
+    if (atomic_load_explicit(&p_lock->m_slots[next % PTICK_SLOTS].m_grant, memory_order_acquire) != next) {
+        return false;
+    }
+    if (!atomic_compare_exchange_strong_explicit(&p_lock->m_next_ticket, &next, next + 1, memory_order_acquire, memory_order_relaxed)) {
+        return false;
+    }
+    p_lock->m_owner = next;
+    return true;
+}
+
+static inline void
+ptick_reset(ptick_t *const p_lock)
+{
+    // Ticket 0 goes straight in. 0 never maps to any of the other slots so
+    // nobody waiting on them can mistake it for their grant.
+    atomic_store_explicit(&p_lock->m_next_ticket, 0, memory_order_relaxed);
+    p_lock->m_owner = 0;
+    for (unsigned i = 0; i < PTICK_SLOTS; ++i) {
+        atomic_store_explicit(&p_lock->m_slots[i].m_grant, 0, memory_order_relaxed);
+    }
+}
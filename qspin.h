@@ -0,0 +1,308 @@
+#pragma once
+
+//
+// Queued spinlock
+//
+// A 4 byte lock modelled on the Linux kernel's qspinlock. The word is split
+// into
+//
+//  bits  0- 7  locked byte
+//  bits  8-15  pending byte (only 0 or 1)
+//  bits 16-17  tail nesting level
+//  bits 18-31  tail thread index + 1
+//
+// Uncontended it is the naive lock, one compare and swap to set the locked
+// byte and one store to clear it.
+//
+// The first thread to find it locked sets the pending bit and spins on the
+// lock word itself, which avoids touching a queue node for the common case of
+// a single waiter. Anyone arriving after that queues up MCS style on an mcs_t
+// taken from a static per-thread array and puts its encoded index in the tail
+// field. Only the thread at the head of the queue spins on the lock word, the
+// rest spin on their own node.
+//
+// A thread is given an index into the node arrays the first time it has to
+// queue, and the index is recycled when the thread exits. A thread can be
+// queued on up to QSPIN_MAX_NESTING locks at once (e.g. from a signal
+// handler), past that it spins on the lock word.
+//
+// The node arrays are weak symbols so every translation unit that includes
+// this header shares them.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "backoff.h"
+#include "mcs.h"
+
+#ifndef QSPIN_MAX_THREADS
+#define QSPIN_MAX_THREADS 1024u
+#endif
+#define QSPIN_MAX_NESTING 4u
+
+#define QSPIN_LOCKED_VAL UINT32_C(0x1)
+#define QSPIN_PENDING_VAL UINT32_C(0x100)
+#define QSPIN_LOCKED_MASK UINT32_C(0xff)
+#define QSPIN_PENDING_MASK UINT32_C(0xff00)
+#define QSPIN_TAIL_SHIFT 16
+#define QSPIN_TAIL_MASK UINT32_C(0xffff0000)
+#define QSPIN_NEST_BITS 2
+
+_Static_assert(QSPIN_MAX_THREADS < (1u << (16 - QSPIN_NEST_BITS)), "the thread index has to fit in the tail");
+_Static_assert(QSPIN_MAX_NESTING == (1u << QSPIN_NEST_BITS), "the nesting level has to fit in the tail");
+
+typedef struct qspinlock qspin_t;
+struct qspinlock {
+    union {
+        _Atomic uint32_t val;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        struct {
+            _Atomic uint8_t locked;
+            _Atomic uint8_t pending;
+        };
+        struct {
+            _Atomic uint16_t locked_pending;
+            _Atomic uint16_t tail;
+        };
+#else
+        struct {
+            _Atomic uint16_t tail;
+            _Atomic uint16_t locked_pending;
+        };
+        struct {
+            uint8_t reserved[2];
+            _Atomic uint8_t pending;
+            _Atomic uint8_t locked;
+        };
+#endif
+    };
+};
+
+_Static_assert(sizeof(qspin_t) == 4, "the lock should be one 32 bit word");
+
+#define QSPIN_INITIALIZER { .val = 0 }
+
+typedef struct {
+    pthread_mutex_t m_mtx;
+    pthread_once_t once;
+    pthread_key_t key;
+    unsigned next_idx;
+    unsigned nfree;
+    uint16_t free_idx[QSPIN_MAX_THREADS];
+} qspin_registry_t;
+
+typedef struct {
+    // Index + 1, 0 until the thread first queues
+    unsigned idx;
+    unsigned nesting;
+} qspin_thread_t;
+
+__attribute__((weak)) mcs_t g_qspin_nodes[QSPIN_MAX_THREADS][QSPIN_MAX_NESTING];
+__attribute__((weak)) qspin_registry_t g_qspin_registry = {
+    .m_mtx = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+__attribute__((weak)) _Thread_local qspin_thread_t t_qspin;
+
+static void
+qspin_put_idx(void *const p)
+{
+    qspin_registry_t *const reg = &g_qspin_registry;
+    pthread_mutex_lock(&reg->m_mtx);
+    reg->free_idx[reg->nfree++] = (uint16_t)(uintptr_t)p;
+    pthread_mutex_unlock(&reg->m_mtx);
+}
+
+static void
+qspin_key_init(void)
+{
+    (void)pthread_key_create(&g_qspin_registry.key, qspin_put_idx);
+}
+
+/**
+ * Give the calling thread an index into the node arrays.
+ */
+__attribute__((noinline))
+static unsigned
+qspin_get_idx(void)
+{
+    qspin_registry_t *const reg = &g_qspin_registry;
+    pthread_once(&reg->once, qspin_key_init);
+
+    unsigned idx = 0;
+    pthread_mutex_lock(&reg->m_mtx);
+    if (reg->nfree > 0) {
+        idx = reg->free_idx[--reg->nfree];
+    } else if (reg->next_idx < QSPIN_MAX_THREADS) {
+        idx = ++reg->next_idx;
+    }
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    if (idx == 0) {
+        fprintf(stderr, "More than %u threads using qspin locks\n", QSPIN_MAX_THREADS);
+        abort();
+    }
+
+    // Given back when the thread exits
+    (void)pthread_setspecific(reg->key, (void *)(uintptr_t)idx);
+    t_qspin.idx = idx;
+    return idx;
+}
+
+__attribute__((always_inline))
+static inline uint16_t
+qspin_encode_tail(unsigned const idx, unsigned const nesting)
+{
+    return (uint16_t)((idx << QSPIN_NEST_BITS) | nesting);
+}
+
+__attribute__((always_inline))
+static inline mcs_t *
+qspin_decode_tail(uint32_t const val)
+{
+    uint32_t const tail = val >> QSPIN_TAIL_SHIFT;
+    return &g_qspin_nodes[(tail >> QSPIN_NEST_BITS) - 1][tail & (QSPIN_MAX_NESTING - 1)];
+}
+
+/**
+ * Try to acquire a queued spinlock.
+ *
+ * @return true if the lock was taken
+ */
+__attribute__((always_inline))
+static inline bool
+qspin_tryacquire(qspin_t *const p_lock)
+{
+    uint32_t l_exp = 0;
+    return atomic_compare_exchange_strong_explicit(&p_lock->val, &l_exp, QSPIN_LOCKED_VAL, memory_order_acquire, memory_order_relaxed);
+}
+
+__attribute__((noinline))
+static void
+qspin_acquire_slow(qspin_t *const p_lock, uint32_t val)
+{
+    backoff_t l_bo = BACKOFF_INIT;
+
+    // The pending waiter is being handed the lock, give it a moment to finish.
+    if (val == QSPIN_PENDING_VAL) {
+        for (int i = 0; i < 64 && val == QSPIN_PENDING_VAL; ++i) {
+            backoff();
+            val = atomic_load_explicit(&p_lock->val, memory_order_relaxed);
+        }
+    }
+
+    // Only the owner, become the pending waiter.
+    if ((val & ~QSPIN_LOCKED_MASK) == 0) {
+        val = atomic_fetch_or_explicit(&p_lock->val, QSPIN_PENDING_VAL, memory_order_acquire);
+        if ((val & ~QSPIN_LOCKED_MASK) == 0) {
+            // Wait for the owner to go away, then take the lock and clear
+            // pending in one store.
+            while ((val & QSPIN_LOCKED_MASK) != 0) {
+                backoff_wait(&l_bo);
+                val = atomic_load_explicit(&p_lock->val, memory_order_acquire);
+            }
+            atomic_store_explicit(&p_lock->locked_pending, QSPIN_LOCKED_VAL, memory_order_relaxed);
+            return;
+        }
+
+        // Someone else got there first. If we were the ones that set pending
+        // take it back off.
+        if ((val & QSPIN_PENDING_MASK) == 0) {
+            atomic_fetch_and_explicit(&p_lock->val, ~QSPIN_PENDING_VAL, memory_order_relaxed);
+        }
+    }
+
+    unsigned const idx = t_qspin.idx != 0 ? t_qspin.idx : qspin_get_idx();
+    unsigned const nesting = t_qspin.nesting;
+    if (nesting >= QSPIN_MAX_NESTING) {
+        // Out of nodes, fall back to spinning on the word.
+        while (!qspin_tryacquire(p_lock)) {
+            backoff_wait(&l_bo);
+        }
+        return;
+    }
+    t_qspin.nesting = nesting + 1;
+
+    mcs_t *const p_node = &g_qspin_nodes[idx - 1][nesting];
+    uint16_t const tail = qspin_encode_tail(idx, nesting);
+
+    atomic_store_explicit(&p_node->m_next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&p_node->m_locked, 1, memory_order_relaxed);
+
+    // Publish our node as the tail. Release so whoever links in behind us sees
+    // the node initialised, acquire for the same reason in the other
+    // direction (the mcs_acquire two acquire case).
+    uint32_t const old = (uint32_t)atomic_exchange_explicit(&p_lock->tail, tail, memory_order_acq_rel) << QSPIN_TAIL_SHIFT;
+    if (old != 0) {
+        mcs_t *const prev = qspin_decode_tail(old);
+        atomic_store_explicit(&prev->m_next, p_node, memory_order_release);
+        mcs_wait_granted(p_node);
+    }
+
+    // At the head of the queue, wait for the owner and the pending waiter.
+    for (;;) {
+        val = atomic_load_explicit(&p_lock->val, memory_order_acquire);
+        if ((val & (QSPIN_LOCKED_MASK | QSPIN_PENDING_MASK)) == 0) {
+            break;
+        }
+        backoff_wait(&l_bo);
+    }
+
+    // If we're the last in the queue take the lock and clear the tail at once.
+    uint32_t const our_tail = (uint32_t)tail << QSPIN_TAIL_SHIFT;
+    if ((val & QSPIN_TAIL_MASK) == our_tail) {
+        if (atomic_compare_exchange_strong_explicit(&p_lock->val, &val, QSPIN_LOCKED_VAL, memory_order_acquire, memory_order_relaxed)) {
+            t_qspin.nesting = nesting;
+            return;
+        }
+    }
+
+    // There's someone behind us. Nobody else can set the locked byte while
+    // the tail is set, and a transient pending bit from a thread backing off
+    // doesn't matter.
+    atomic_store_explicit(&p_lock->locked, 1, memory_order_relaxed);
+
+    mcs_t *const next = mcs_wait_next(p_node);
+    atomic_store_explicit(&next->m_locked, 0, memory_order_release);
+    t_qspin.nesting = nesting;
+}
+
+/**
+ * Acquire a queued spinlock.
+ *
+ * @param p_lock The actual lock.
+ */
+__attribute__((always_inline))
+static inline void
+qspin_acquire(qspin_t *const p_lock)
+{
+    uint32_t l_exp = 0;
+    if (__builtin_expect(atomic_compare_exchange_strong_explicit(&p_lock->val, &l_exp, QSPIN_LOCKED_VAL, memory_order_acquire, memory_order_relaxed), 1)) {
+        return;
+    }
+    qspin_acquire_slow(p_lock, l_exp);
+}
+
+/**
+ * Release a queued spinlock.
+ *
+ * @param p_lock The actual lock.
+ */
+__attribute__((always_inline))
+static inline void
+qspin_release(qspin_t *const p_lock)
+{
+    atomic_store_explicit(&p_lock->locked, 0, memory_order_release);
+}
+
+static inline void
+qspin_reset(qspin_t *const p_lock)
+{
+    atomic_store_explicit(&p_lock->val, 0, memory_order_relaxed);
+}
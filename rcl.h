@@ -0,0 +1,236 @@
+#pragma once
+
+//
+// Remote core locking
+//
+// Lozi, David, Thomas, Lawall and Muller's remote core locking. One server
+// thread, ideally pinned to a cpu of its own, runs every critical section.
+// The protected data never leaves the server's cache; the only lines that
+// move between cpus are the clients' mailboxes.
+//
+// Each client has a padded mailbox, laid out like the GTA lock's gs_t. To run
+// a critical section the client writes the function and its argument into
+// its mailbox, marks it posted and spins on it until the server marks it
+// done. The server loops over the mailboxes running whatever is posted.
+//
+// When the server isn't running, clients take the fallback MCS lock and run
+// the critical section themselves. The server holds the fallback lock the
+// whole time it is running, so critical sections run by the server and by
+// clients never overlap.
+//
+// Stopping: rcl_stop() moves the server from RUNNING to STOPPING. The server
+// serves what's posted one last time, marks itself STOPPED and releases the
+// fallback lock. A client that posted too late to be served sees STOPPED
+// with its mailbox still posted and runs the critical section under the
+// fallback lock instead. After STOPPED the server never touches a mailbox,
+// so nothing is run twice. Don't restart the server until every client that
+// was waiting when it stopped has returned, or a new server could pick up a
+// request its client is about to run itself.
+//
+// Mailboxes are indexed by a client ID below the mailbox count, like the GTA
+// lock. gta_auto_thread_id() from gta_auto.h is one way to get one.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "backoff.h"
+#include "mcs.h"
+
+#define RCL_EMPTY 0
+#define RCL_POSTED 1
+#define RCL_DONE 2
+
+#define RCL_STOPPED 0
+#define RCL_RUNNING 1
+#define RCL_STOPPING 2
+
+typedef void *(*rcl_fn_t)(void *arg);
+
+typedef struct {
+    alignas(64) atomic_int m_state;
+    rcl_fn_t m_fn;
+    void *m_arg;
+    void *m_ret;
+} rcl_mailbox_t;
+
+typedef struct rcl_lock rcl_t;
+
+struct rcl_lock {
+    // Read by every client, only written when starting and stopping
+    alignas(64) atomic_int m_server;
+    unsigned m_nmailboxes;
+    rcl_mailbox_t *m_mailboxes;
+    // cpu the server is pinned to, -1 for none
+    int m_cpu;
+    pthread_t m_thread;
+    alignas(64) mcs_lock_t m_fallback;
+};
+
+/**
+ * Run fn(arg) under the fallback lock.
+ */
+static inline void *
+rcl_run_locally(rcl_t *const p_lock, rcl_fn_t const fn, void *const arg)
+{
+    mcs_lock(&p_lock->m_fallback);
+    void *const ret = fn(arg);
+    mcs_unlock(&p_lock->m_fallback);
+    return ret;
+}
+
+/**
+ * Run fn(arg) on the server, or locally if the server isn't running.
+ *
+ * @param p_lock The actual lock.
+ * @param id The client's mailbox, below m_nmailboxes and not shared with a
+ * thread that could be using it at the same time.
+ * @param fn The critical section.
+ * @param arg Passed to fn.
+ * @return What fn returned.
+ */
+static inline void *
+rcl_execute(rcl_t *const p_lock, unsigned const id, rcl_fn_t const fn, void *const arg)
+{
+    if (atomic_load_explicit(&p_lock->m_server, memory_order_acquire) != RCL_RUNNING) {
+        return rcl_run_locally(p_lock, fn, arg);
+    }
+
+    rcl_mailbox_t *const mb = &p_lock->m_mailboxes[id];
+    mb->m_fn = fn;
+    mb->m_arg = arg;
+    // Release so the server sees the request filled in.
+    atomic_store_explicit(&mb->m_state, RCL_POSTED, memory_order_release);
+
+    backoff_t l_bo = BACKOFF_INIT;
+    for (;;) {
+        // Acquire pairs with the server's release, for m_ret and whatever fn
+        // wrote.
+        if (atomic_load_explicit(&mb->m_state, memory_order_acquire) == RCL_DONE) {
+            break;
+        }
+        if (atomic_load_explicit(&p_lock->m_server, memory_order_acquire) == RCL_STOPPED) {
+            // The server is gone. It either got to us on the way out or never
+            // will.
+            if (atomic_load_explicit(&mb->m_state, memory_order_acquire) == RCL_DONE) {
+                break;
+            }
+            atomic_store_explicit(&mb->m_state, RCL_EMPTY, memory_order_relaxed);
+            return rcl_run_locally(p_lock, fn, arg);
+        }
+        backoff_wait(&l_bo);
+    }
+
+    atomic_store_explicit(&mb->m_state, RCL_EMPTY, memory_order_relaxed);
+    return mb->m_ret;
+}
+
+/**
+ * Run everything posted.
+ *
+ * @return How many requests were run
+ */
+static inline unsigned
+rcl_serve(rcl_t *const p_lock)
+{
+    unsigned served = 0;
+    for (unsigned i = 0; i < p_lock->m_nmailboxes; ++i) {
+        rcl_mailbox_t *const mb = &p_lock->m_mailboxes[i];
+        if (atomic_load_explicit(&mb->m_state, memory_order_acquire) != RCL_POSTED) {
+            continue;
+        }
+        mb->m_ret = mb->m_fn(mb->m_arg);
+        atomic_store_explicit(&mb->m_state, RCL_DONE, memory_order_release);
+        ++served;
+    }
+    return served;
+}
+
+static void *
+rcl_server(void *const arg)
+{
+    rcl_t *const p_lock = arg;
+
+#if defined(_GNU_SOURCE)
+    if (p_lock->m_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(p_lock->m_cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            fprintf(stderr, "Failed to pin the RCL server to cpu %d\n", p_lock->m_cpu);
+        }
+    }
+#endif
+
+    // Anyone already running locally finishes first.
+    mcs_lock(&p_lock->m_fallback);
+    atomic_store_explicit(&p_lock->m_server, RCL_RUNNING, memory_order_release);
+
+    backoff_t l_bo = BACKOFF_INIT;
+    while (atomic_load_explicit(&p_lock->m_server, memory_order_relaxed) == RCL_RUNNING) {
+        if (rcl_serve(p_lock) != 0) {
+            l_bo = (backoff_t)BACKOFF_INIT;
+        } else {
+            backoff_wait(&l_bo);
+        }
+    }
+
+    // Serve what's posted one more time. Anyone posting after this sees
+    // STOPPED and runs locally once we've let go of the fallback lock.
+    (void)rcl_serve(p_lock);
+    atomic_store_explicit(&p_lock->m_server, RCL_STOPPED, memory_order_release);
+    mcs_unlock(&p_lock->m_fallback);
+    return NULL;
+}
+
+/**
+ * Start the server thread and wait for it to take over.
+ *
+ * @param cpu cpu to pin the server to, -1 for none
+ * @return 0 on success
+ */
+static inline int
+rcl_start(rcl_t *const p_lock, int const cpu)
+{
+    p_lock->m_cpu = cpu;
+    if (pthread_create(&p_lock->m_thread, NULL, rcl_server, p_lock) != 0) {
+        return -1;
+    }
+    while (atomic_load_explicit(&p_lock->m_server, memory_order_acquire) != RCL_RUNNING) {
+        sched_yield();
+    }
+    return 0;
+}
+
+/**
+ * Stop the server thread and wait for it to exit. Clients can keep calling
+ * rcl_execute() throughout.
+ */
+static inline void
+rcl_stop(rcl_t *const p_lock)
+{
+    atomic_store_explicit(&p_lock->m_server, RCL_STOPPING, memory_order_relaxed);
+    pthread_join(p_lock->m_thread, NULL);
+}
+
+/**
+ * Reset an RCL lock to stopped.
+ *
+ * The caller sets m_mailboxes to an array of nmailboxes mailboxes first.
+ */
+static inline void
+rcl_reset(rcl_t *const p_lock, unsigned const nmailboxes)
+{
+    atomic_store_explicit(&p_lock->m_server, RCL_STOPPED, memory_order_relaxed);
+    p_lock->m_nmailboxes = nmailboxes;
+    p_lock->m_cpu = -1;
+    mcs_lock_reset(&p_lock->m_fallback);
+    for (unsigned i = 0; i < nmailboxes; ++i) {
+        atomic_store_explicit(&p_lock->m_mailboxes[i].m_state, RCL_EMPTY, memory_order_relaxed);
+    }
+}
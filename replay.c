@@ -0,0 +1,1128 @@
+//
+// Replay a lock trace against every lock in the repo.
+//
+// Reads a trace written by trace_dump() (trace.h) and turns each thread's
+// events into a program of acquires and releases with the recorded delay
+// before each one. The time between asking for a lock and getting it is
+// left out since that's what depends on the lock. Threads start with the
+// same offsets they had in the trace so the arrival pattern is reproduced.
+//
+// Every distinct lock id in the trace gets its own lock, so nested locking
+// is replayed as it happened.
+//
+// The first CSV row is the acquire latency that was recorded, the rest are
+// one row per lock replayed.
+//
+// gcc -O2 -pthread -o replay replay.c
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cycles.h"
+#include "backoff_calibrate.h"
+#include "hist.h"
+#include "trace.h"
+#include "lock_list.h"
+#include "naive.h"
+#include "ticket.h"
+#include "ptick.h"
+#include "mcs.h"
+#include "gta.h"
+#include "gta_auto.h"
+#include "anderson.h"
+#include "cohort.h"
+#include "cna.h"
+#include "mcs_cr.h"
+#include "clh.h"
+#include "hemlock.h"
+#include "qspin.h"
+#include "mcs_park.h"
+#include "mcs_tp.h"
+
+typedef enum {
+    STEP_ACQ,
+    STEP_REL,
+} step_op;
+
+typedef struct {
+    uint64_t delay;     // Cycles to spin before doing op
+    uint32_t lock;      // Index into the replayed locks
+    uint32_t op;
+} step_t;
+
+typedef struct {
+    step_t *steps;
+    uint64_t nsteps;
+} program_t;
+
+typedef struct {
+    alignas(128) union {
+        atomic_uint naive;
+        tick_t ticket;
+        ptick_t ptick;
+        mcs_t mcs;
+        mcs_lock_t mcs_lock;
+        gta_t gta;
+        gta_auto_t gta_auto;
+        anderson_t anderson;
+        cohort_t cohort;
+        hemlock_t hemlock;
+        qspin_t qspin;
+        mcs_park_t mcs_park;
+        mcs_tp_t mcs_tp;
+        struct {
+            clh_t lock;
+            // The initial node then one per thread
+            clh_node_t *nodes;
+        } clh;
+    };
+} replay_lock;
+
+typedef struct {
+    long num_threads;
+    uint32_t num_locks;
+    replay_lock *locks;
+    pthread_barrier_t barrier;
+    atomic_uint start_barrier;
+} replay_state;
+
+typedef struct {
+    replay_state *state;
+    program_t const *prog;
+    // One node per lock so nested locks can be replayed
+    mcs_t *nodes;
+    mcs_park_t *park_nodes;
+    mcs_tp_node_t *tp_nodes;
+    // The CLH node this thread currently owns for each lock
+    clh_node_t **clh;
+    unsigned threadnum;
+    int corenum;
+    uint64_t start_cc;
+    uint64_t end_cc;
+    hist_t *hist;
+} replay_arg;
+
+typedef struct {
+    char const *name;
+    void (*init)(replay_state *);
+    void (*fini)(replay_state *);
+    void *(*routine)(void *);
+} lock_impl;
+
+static void
+pin_to_cpu(int const cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+        abort();
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+spin_cycles(uint64_t const cycles)
+{
+    if (cycles == 0) {
+        return;
+    }
+    uint64_t const start = cycles_now();
+    while (cycles_now() - start < cycles) {
+        backoff();
+    }
+}
+
+//
+// Lock adapters, see bench.c
+//
+
+typedef void lock_fn(replay_lock *lock, replay_arg *rarg, uint32_t idx);
+
+static void
+no_fini(replay_state *const st)
+{
+    (void)st;
+}
+
+static void
+naive_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        atomic_init(&st->locks[i].naive, 0);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+naive_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    acquire(&lock->naive);
+}
+
+__attribute__((always_inline))
+static inline void
+naive_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    release(&lock->naive);
+}
+
+static void
+ticket_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        atomic_init(&st->locks[i].ticket.total, 0);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+ticket_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    ticket_acq(&lock->ticket);
+}
+
+__attribute__((always_inline))
+static inline void
+ticket_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    ticket_rel(&lock->ticket);
+}
+
+static void
+ptick_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        ptick_reset(&st->locks[i].ptick);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+ptick_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    ptick_acq(&lock->ptick);
+}
+
+__attribute__((always_inline))
+static inline void
+ptick_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    ptick_rel(&lock->ptick);
+}
+
+static void
+mcs_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        st->locks[i].mcs = (mcs_t) {
+            .m_next = NULL,
+            .m_locked = 0
+        };
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_acquire(&lock->mcs, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_release(&lock->mcs, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_replay_rel2(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_release2(&lock->mcs, &rarg->nodes[idx]);
+}
+
+static void
+mcs_lock_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        mcs_lock_reset(&st->locks[i].mcs_lock);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_lock_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    mcs_lock(&lock->mcs_lock);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_lock_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    mcs_unlock(&lock->mcs_lock);
+}
+
+static void
+gta_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        size_t const sz = (st->num_threads + 1) * sizeof(gs_t);
+        gta_t *const p_lock = &st->locks[i].gta;
+        p_lock->slots = aligned_alloc(64, sz);
+        if (p_lock->slots == NULL) {
+            fprintf(stderr, "Failed to allocate GTA slots\n");
+            abort();
+        }
+        memset(p_lock->slots, 0, sz);
+        p_lock->m_allocsz = sz;
+        gta_reset(p_lock);
+    }
+}
+
+static void
+gta_fini(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        free(st->locks[i].gta.slots);
+    }
+}
+
+static void
+gta_auto_replay_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        gta_auto_init(&st->locks[i].gta_auto);
+    }
+}
+
+static void
+gta_auto_replay_fini(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        gta_auto_destroy(&st->locks[i].gta_auto);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    gta_auto_acquire(&lock->gta_auto);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_auto_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    gta_auto_release(&lock->gta_auto);
+}
+
+static void
+anderson_init(replay_state *const st)
+{
+    unsigned const nslots = anderson_slot_count((unsigned)st->num_threads);
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        size_t const sz = nslots * sizeof(gs_t);
+        anderson_t *const p_lock = &st->locks[i].anderson;
+        p_lock->slots = aligned_alloc(64, sz);
+        if (p_lock->slots == NULL) {
+            fprintf(stderr, "Failed to allocate Anderson slots\n");
+            abort();
+        }
+        p_lock->m_allocsz = sz;
+        anderson_reset(p_lock, nslots);
+    }
+}
+
+static void
+anderson_fini(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        free(st->locks[i].anderson.slots);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+anderson_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    anderson_acquire(&lock->anderson);
+}
+
+__attribute__((always_inline))
+static inline void
+anderson_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    anderson_release(&lock->anderson);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)idx;
+    gta_acquire(&lock->gta, rarg->threadnum + 1);
+}
+
+__attribute__((always_inline))
+static inline void
+gta_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)idx;
+    gta_release(&lock->gta, rarg->threadnum + 1);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_cr_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_cr_acquire(&lock->mcs, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_cr_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_cr_release(&lock->mcs, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+cna_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    cna_acquire(&lock->mcs, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+cna_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    cna_release(&lock->mcs, &rarg->nodes[idx]);
+}
+
+static void
+clh_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        clh_node_t *const nodes = aligned_alloc(64, (st->num_threads + 1) * sizeof(clh_node_t));
+        if (nodes == NULL) {
+            fprintf(stderr, "Failed to allocate CLH nodes\n");
+            abort();
+        }
+        st->locks[i].clh.nodes = nodes;
+        clh_reset(&st->locks[i].clh.lock, &nodes[0]);
+    }
+}
+
+static void
+clh_fini(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        free(st->locks[i].clh.nodes);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+clh_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    clh_acquire(&lock->clh.lock, &rarg->clh[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+clh_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    clh_release(&lock->clh.lock, &rarg->clh[idx]);
+}
+
+static void
+hemlock_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        hemlock_reset(&st->locks[i].hemlock);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+hemlock_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    hemlock_acquire(&lock->hemlock);
+}
+
+__attribute__((always_inline))
+static inline void
+hemlock_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    hemlock_release(&lock->hemlock);
+}
+
+static void
+qspin_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        qspin_reset(&st->locks[i].qspin);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+qspin_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    qspin_acquire(&lock->qspin);
+}
+
+__attribute__((always_inline))
+static inline void
+qspin_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    (void)rarg;
+    (void)idx;
+    qspin_release(&lock->qspin);
+}
+
+static void
+mcs_park_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        st->locks[i].mcs_park = (mcs_park_t)MCS_PARK_INITIALIZER;
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_park_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_park_acquire(&lock->mcs_park, &rarg->park_nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_park_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_park_release(&lock->mcs_park, &rarg->park_nodes[idx]);
+}
+
+static void
+mcs_tp_init(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        mcs_tp_reset(&st->locks[i].mcs_tp, MCS_TP_PATIENCE_NS);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_tp_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_tp_acquire(&lock->mcs_tp, &rarg->tp_nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+mcs_tp_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    mcs_tp_release(&lock->mcs_tp, &rarg->tp_nodes[idx]);
+}
+
+static void
+cohort_init(replay_state *const st)
+{
+    unsigned const nnodes = numa_node_count();
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        mcs_t *const p_local = aligned_alloc(64, nnodes * sizeof(mcs_t));
+        if (p_local == NULL) {
+            fprintf(stderr, "Failed to allocate cohort local locks\n");
+            abort();
+        }
+        cohort_reset(&st->locks[i].cohort, p_local, nnodes, COHORT_DEFAULT_BATCH);
+    }
+}
+
+static void
+cohort_fini(replay_state *const st)
+{
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        free(st->locks[i].cohort.m_local);
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+cohort_replay_acq(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    cohort_acquire(&lock->cohort, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void
+cohort_replay_rel(replay_lock *const lock, replay_arg *const rarg, uint32_t const idx)
+{
+    cohort_release(&lock->cohort, &rarg->nodes[idx]);
+}
+
+__attribute__((always_inline))
+static inline void *
+replay_routine(replay_arg *const rarg, lock_fn *const lock, lock_fn *const unlock)
+{
+    replay_state *const st = rarg->state;
+    program_t const *const prog = rarg->prog;
+
+    pin_to_cpu(rarg->corenum);
+
+    hist_t *const l_hist = aligned_alloc(64, sizeof(*l_hist));
+    if (l_hist == NULL) {
+        fprintf(stderr, "Failed to allocate histogram\n");
+        abort();
+    }
+    hist_reset(l_hist);
+    rarg->hist = l_hist;
+
+    pthread_barrier_wait(&st->barrier);
+
+    // Spin until all threads are running on their cores
+    atomic_fetch_add(&st->start_barrier, 1);
+    while (atomic_load(&st->start_barrier) < st->num_threads) {
+        backoff();
+    }
+
+    replay_lock *const locks = st->locks;
+
+    rarg->start_cc = cycles_now();
+    for (uint64_t i = 0; i < prog->nsteps; ++i) {
+        step_t const *const step = &prog->steps[i];
+        spin_cycles(step->delay);
+        if (step->op == STEP_ACQ) {
+            uint64_t const t1 = cycles_now();
+            lock(&locks[step->lock], rarg, step->lock);
+            uint64_t const t2 = cycles_now();
+            hist_record(l_hist, t2 - t1);
+        } else {
+            unlock(&locks[step->lock], rarg, step->lock);
+        }
+    }
+    rarg->end_cc = cycles_now();
+
+    return NULL;
+}
+
+static void *
+naive_routine(void *const arg)
+{
+    return replay_routine(arg, naive_replay_acq, naive_replay_rel);
+}
+
+static void *
+ticket_routine(void *const arg)
+{
+    return replay_routine(arg, ticket_replay_acq, ticket_replay_rel);
+}
+
+static void *
+ptick_routine(void *const arg)
+{
+    return replay_routine(arg, ptick_replay_acq, ptick_replay_rel);
+}
+
+static void *
+mcs_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_replay_acq, mcs_replay_rel);
+}
+
+static void *
+mcs2_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_replay_acq, mcs_replay_rel2);
+}
+
+static void *
+mcs_lock_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_lock_replay_acq, mcs_lock_replay_rel);
+}
+
+static void *
+gta_routine(void *const arg)
+{
+    return replay_routine(arg, gta_replay_acq, gta_replay_rel);
+}
+
+static void *
+gta_auto_routine(void *const arg)
+{
+    return replay_routine(arg, gta_auto_replay_acq, gta_auto_replay_rel);
+}
+
+static void *
+anderson_routine(void *const arg)
+{
+    return replay_routine(arg, anderson_replay_acq, anderson_replay_rel);
+}
+
+static void *
+cohort_routine(void *const arg)
+{
+    return replay_routine(arg, cohort_replay_acq, cohort_replay_rel);
+}
+
+static void *
+mcs_cr_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_cr_replay_acq, mcs_cr_replay_rel);
+}
+
+static void *
+cna_routine(void *const arg)
+{
+    return replay_routine(arg, cna_replay_acq, cna_replay_rel);
+}
+
+static void *
+clh_routine(void *const arg)
+{
+    replay_arg *const rarg = arg;
+    replay_state *const st = rarg->state;
+    for (uint32_t i = 0; i < st->num_locks; ++i) {
+        rarg->clh[i] = &st->locks[i].clh.nodes[rarg->threadnum + 1];
+    }
+    return replay_routine(rarg, clh_replay_acq, clh_replay_rel);
+}
+
+static void *
+hemlock_routine(void *const arg)
+{
+    return replay_routine(arg, hemlock_replay_acq, hemlock_replay_rel);
+}
+
+static void *
+qspin_routine(void *const arg)
+{
+    return replay_routine(arg, qspin_replay_acq, qspin_replay_rel);
+}
+
+static void *
+mcs_park_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_park_replay_acq, mcs_park_replay_rel);
+}
+
+static void *
+mcs_tp_routine(void *const arg)
+{
+    return replay_routine(arg, mcs_tp_replay_acq, mcs_tp_replay_rel);
+}
+
+static lock_impl const g_impls[] = {
+    { "naive",  naive_init,  no_fini,  naive_routine },
+    { "ticket", ticket_init, no_fini,  ticket_routine },
+    { "ptick",  ptick_init,  no_fini,  ptick_routine },
+    { "mcs",    mcs_init,    no_fini,  mcs_routine },
+    { "mcs2",   mcs_init,    no_fini,  mcs2_routine },
+    { "mcslock", mcs_lock_init, no_fini, mcs_lock_routine },
+    { "mcspark", mcs_park_init, no_fini, mcs_park_routine },
+    { "mcstp",  mcs_tp_init, no_fini,  mcs_tp_routine },
+    { "gta",    gta_init,    gta_fini, gta_routine },
+    { "gtaauto", gta_auto_replay_init, gta_auto_replay_fini, gta_auto_routine },
+    { "anderson", anderson_init, anderson_fini, anderson_routine },
+    { "clh",    clh_init,    clh_fini, clh_routine },
+    { "hemlock", hemlock_init, no_fini, hemlock_routine },
+    { "qspin",  qspin_init,  no_fini,  qspin_routine },
+    { "cohort", cohort_init, cohort_fini, cohort_routine },
+    { "cna",    mcs_init,    no_fini,  cna_routine },
+    { "mcscr",  mcs_init,    no_fini,  mcs_cr_routine },
+};
+
+#define NUM_IMPLS (sizeof(g_impls) / sizeof(g_impls[0]))
+
+static uint32_t
+lock_index(uint32_t *const ids, uint32_t *const nids, uint32_t const id)
+{
+    for (uint32_t i = 0; i < *nids; ++i) {
+        if (ids[i] == id) {
+            return i;
+        }
+    }
+    ids[*nids] = id;
+    return (*nids)++;
+}
+
+/**
+ * Load a trace and turn it into one program per thread.
+ *
+ * @param recorded Filled with the acquire latencies in the trace
+ * @param p_span Set to the cycles from the first to the last event
+ * @return The number of threads, or -1 on error
+ */
+static long
+load_trace(char const *const path, program_t **const p_progs, uint32_t *const p_nlocks, hist_t *const recorded,
+        uint64_t *const p_span)
+{
+    FILE *const f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+
+    trace_file_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a lock trace\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    // Delays are scaled if this machine's counter runs at a different rate
+    double const scale = hdr.cycles_per_sec != 0 ? (double)cycles_per_sec() / hdr.cycles_per_sec : 1.0;
+
+    trace_ev_t **const events = calloc(hdr.nthreads, sizeof(*events));
+    uint64_t *const counts = calloc(hdr.nthreads, sizeof(*counts));
+    program_t *const progs = calloc(hdr.nthreads, sizeof(*progs));
+    if (events == NULL || counts == NULL || progs == NULL) {
+        fprintf(stderr, "Failed to allocate trace\n");
+        abort();
+    }
+
+    uint64_t total = 0;
+    uint64_t first_ts = UINT64_MAX;
+    uint64_t last_ts = 0;
+    for (uint32_t t = 0; t < hdr.nthreads; ++t) {
+        trace_thread_hdr_t thdr;
+        if (fread(&thdr, sizeof(thdr), 1, f) != 1) {
+            fprintf(stderr, "Truncated trace\n");
+            fclose(f);
+            return -1;
+        }
+        counts[t] = thdr.count;
+        events[t] = malloc(thdr.count * sizeof(trace_ev_t) + 1);
+        if (events[t] == NULL) {
+            fprintf(stderr, "Failed to allocate trace\n");
+            abort();
+        }
+        if (fread(events[t], sizeof(trace_ev_t), thdr.count, f) != thdr.count) {
+            fprintf(stderr, "Truncated trace\n");
+            fclose(f);
+            return -1;
+        }
+        total += thdr.count;
+        if (thdr.count > 0 && events[t][0].ts < first_ts) {
+            first_ts = events[t][0].ts;
+        }
+        if (thdr.count > 0 && events[t][thdr.count - 1].ts > last_ts) {
+            last_ts = events[t][thdr.count - 1].ts;
+        }
+    }
+    fclose(f);
+
+    // Per lock state while building each program, there can't be more locks
+    // than events.
+    uint32_t *const ids = malloc((total + 1) * sizeof(*ids));
+    bool *const held = calloc(total + 1, sizeof(*held));
+    uint64_t *const req_ts = calloc(total + 1, sizeof(*req_ts));
+    if (ids == NULL || held == NULL || req_ts == NULL) {
+        fprintf(stderr, "Failed to allocate lock ids\n");
+        abort();
+    }
+    uint32_t nids = 0;
+
+    for (uint32_t t = 0; t < hdr.nthreads; ++t) {
+        trace_ev_t const *const ev = events[t];
+        // At most one step per event plus releasing whatever is still held
+        step_t *const steps = malloc((counts[t] * 2 + 1) * sizeof(*steps));
+        if (steps == NULL) {
+            fprintf(stderr, "Failed to allocate program\n");
+            abort();
+        }
+
+        uint64_t n = 0;
+        // Start at the same offset this thread started at in the trace
+        uint64_t prev_ts = first_ts;
+        for (uint64_t i = 0; i < counts[t]; ++i) {
+            uint32_t const idx = lock_index(ids, &nids, ev[i].lock);
+            switch (ev[i].type) {
+            case TRACE_EV_REQUEST:
+                if (held[idx]) {
+                    break;
+                }
+                steps[n++] = (step_t) {
+                    .delay = (uint64_t)((ev[i].ts - prev_ts) * scale),
+                    .lock = idx,
+                    .op = STEP_ACQ,
+                };
+                held[idx] = true;
+                req_ts[idx] = ev[i].ts;
+                prev_ts = ev[i].ts;
+                break;
+            case TRACE_EV_ACQUIRED:
+                // The wait is up to the lock being replayed
+                if (held[idx]) {
+                    hist_record(recorded, ev[i].ts - req_ts[idx]);
+                    prev_ts = ev[i].ts;
+                }
+                break;
+            case TRACE_EV_RELEASED:
+                // Skip releases of locks taken before the ring buffer starts
+                if (!held[idx]) {
+                    break;
+                }
+                steps[n++] = (step_t) {
+                    .delay = (uint64_t)((ev[i].ts - prev_ts) * scale),
+                    .lock = idx,
+                    .op = STEP_REL,
+                };
+                held[idx] = false;
+                prev_ts = ev[i].ts;
+                break;
+            default:
+                break;
+            }
+        }
+        for (uint32_t idx = 0; idx < nids; ++idx) {
+            if (held[idx]) {
+                steps[n++] = (step_t) { .delay = 0, .lock = idx, .op = STEP_REL };
+                held[idx] = false;
+            }
+        }
+
+        progs[t].steps = steps;
+        progs[t].nsteps = n;
+        free(events[t]);
+    }
+
+    free(req_ts);
+    free(held);
+    free(ids);
+    free(counts);
+    free(events);
+
+    *p_progs = progs;
+    *p_nlocks = nids;
+    *p_span = last_ts > first_ts ? (uint64_t)((last_ts - first_ts) * scale) : 0;
+    return hdr.nthreads;
+}
+
+static void
+print_row(char const *const name, long const nthreads, hist_t const *const hist, uint64_t const cycles)
+{
+    double const secs = (double)cycles / cycles_per_sec();
+    printf("%s,%ld,%"PRIu64",%"PRIu64",%.0f,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+            name, nthreads, hist->count, cycles, secs > 0.0 ? hist->count / secs : 0.0,
+            hist_percentile(hist, 50.0), hist_percentile(hist, 99.0),
+            hist_percentile(hist, 99.9), hist->max);
+    fflush(stdout);
+}
+
+static void
+usage(char const *const prog)
+{
+    fprintf(stderr,
+            "usage: %s [-l lock] [-r runs] trace\n"
+            "  -l  comma separated locks to replay with (default all):", prog);
+    for (size_t i = 0; i < NUM_IMPLS; ++i) {
+        fprintf(stderr, " %s", g_impls[i].name);
+    }
+    fprintf(stderr,
+            "\n"
+            "  -r  number of times to replay with each lock (default 1)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char const *lock_name = "all";
+    long num_runs = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "l:r:h")) != -1) {
+        switch (c) {
+        case 'l':
+            lock_name = optarg;
+            break;
+        case 'r':
+            num_runs = strtol(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char const *names[NUM_IMPLS];
+    for (size_t i = 0; i < NUM_IMPLS; ++i) {
+        names[i] = g_impls[i].name;
+    }
+    size_t unknown_len;
+    char const *const unknown = lock_list_unknown(lock_name, names, NUM_IMPLS, &unknown_len);
+    if (unknown != NULL) {
+        fprintf(stderr, "Unknown lock %.*s\n", (int)unknown_len, unknown);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#if BACKOFF_POLICY != BACKOFF_DEFAULT
+    backoff_calibrate();
+    fprintf(stderr, "Backoff %s: %" PRIu64 " cycles per pause, %" PRIu64 " cycles per handoff\n",
+            BACKOFF_POLICY_NAME, g_backoff.pause_cycles, g_backoff.handoff_cycles);
+#endif
+
+    static hist_t s_hist;
+    hist_reset(&s_hist);
+
+    program_t *progs;
+    uint32_t nlocks;
+    uint64_t span;
+    long const nthreads = load_trace(argv[optind], &progs, &nlocks, &s_hist, &span);
+    if (nthreads < 0) {
+        return EXIT_FAILURE;
+    }
+    if (nthreads == 0 || nlocks == 0) {
+        fprintf(stderr, "The trace has no lock events\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Replaying %ld threads on %u locks\n", nthreads, nlocks);
+
+    replay_state *const st = malloc(sizeof(*st));
+    replay_arg *const rargs = calloc(nthreads, sizeof(*rargs));
+    pthread_t *const threads = malloc(nthreads * sizeof(*threads));
+    replay_lock *const locks = aligned_alloc(128, nlocks * sizeof(*locks));
+    if (st == NULL || rargs == NULL || threads == NULL || locks == NULL) {
+        fprintf(stderr, "Failed to allocate replay state\n");
+        abort();
+    }
+    memset(st, 0, sizeof(*st));
+    st->num_threads = nthreads;
+    st->num_locks = nlocks;
+    st->locks = locks;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Failed to get the cpu affinity\n");
+        abort();
+    }
+    if (nthreads > CPU_COUNT(&allowed)) {
+        fprintf(stderr, "Warning: %ld threads on %d cpus, threads will share cpus\n",
+                nthreads, CPU_COUNT(&allowed));
+    }
+
+    int core_idx = 0;
+    for (long i = 0; i < nthreads; ++i) {
+        // Find the next usable core, wrapping around if we run out
+        while (!CPU_ISSET(core_idx, &allowed)) {
+            core_idx = (core_idx + 1) % CPU_SETSIZE;
+        }
+        rargs[i].state = st;
+        rargs[i].prog = &progs[i];
+        rargs[i].threadnum = (unsigned)i;
+        rargs[i].corenum = core_idx;
+        rargs[i].nodes = aligned_alloc(64, nlocks * sizeof(mcs_t));
+        rargs[i].park_nodes = aligned_alloc(64, nlocks * sizeof(mcs_park_t));
+        rargs[i].tp_nodes = aligned_alloc(64, nlocks * sizeof(mcs_tp_node_t));
+        rargs[i].clh = malloc(nlocks * sizeof(*rargs[i].clh));
+        if (rargs[i].nodes == NULL || rargs[i].park_nodes == NULL || rargs[i].tp_nodes == NULL || rargs[i].clh == NULL) {
+            fprintf(stderr, "Failed to allocate nodes\n");
+            abort();
+        }
+        // Start the spin then park locks at the default spin budget
+        memset(rargs[i].park_nodes, 0, nlocks * sizeof(mcs_park_t));
+        core_idx = (core_idx + 1) % CPU_SETSIZE;
+    }
+
+    printf("lock,threads,acquisitions,total_cycles,acq_per_sec,acq_p50,acq_p99,acq_p999,acq_max\n");
+
+    // What the trace itself saw
+    print_row("recorded", nthreads, &s_hist, span);
+
+    for (long r = 0; r < num_runs; ++r) {
+        for (size_t i = 0; i < NUM_IMPLS; ++i) {
+            lock_impl const *const impl = &g_impls[i];
+            if (!lock_selected(lock_name, impl->name)) {
+                continue;
+            }
+
+            impl->init(st);
+            st->start_barrier = 0;
+            pthread_barrier_init(&st->barrier, NULL, nthreads + 1);
+
+            for (long t = 0; t < nthreads; ++t) {
+                if (pthread_create(&threads[t], NULL, impl->routine, &rargs[t]) != 0) {
+                    fprintf(stderr, "Failed to create thread %ld\n", t);
+                    abort();
+                }
+            }
+            pthread_barrier_wait(&st->barrier);
+
+            hist_reset(&s_hist);
+            uint64_t start = UINT64_MAX;
+            uint64_t end = 0;
+            for (long t = 0; t < nthreads; ++t) {
+                pthread_join(threads[t], NULL);
+                hist_merge(&s_hist, rargs[t].hist);
+                free(rargs[t].hist);
+                rargs[t].hist = NULL;
+                if (rargs[t].start_cc < start) {
+                    start = rargs[t].start_cc;
+                }
+                if (rargs[t].end_cc > end) {
+                    end = rargs[t].end_cc;
+                }
+            }
+
+            pthread_barrier_destroy(&st->barrier);
+            impl->fini(st);
+
+            print_row(impl->name, nthreads, &s_hist, end - start);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+//
+// Lock contention statistics
+//
+// Build with -DLOCK_STATS to have the locks count, per thread:
+//
+// - acquisitions
+// - contended acquisitions, where the lock wasn't immediately available
+// - spin iterations spent waiting for the lock
+// - slow releases, where mcs_release found no successor in m_next but a
+//   waiter had already swapped itself into the tail, so it has to wait for
+//   the waiter to link in (the "false uncontended" case)
+//
+// Each thread only writes its own counters so turning this on adds no shared
+// cache line writes. lock_stats_snapshot() adds up every thread's counters,
+// including threads that have exited.
+//
+// Without LOCK_STATS the macros expand to nothing and none of the rest of
+// this header is compiled, so the locks compile to exactly the same code as
+// without it.
+//
+// The registry is a weak symbol so every translation unit that includes this
+// header shares it.
+//
+
+#ifdef LOCK_STATS
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef enum {
+    LOCK_STATS_NAIVE,
+    LOCK_STATS_TICKET,
+    LOCK_STATS_MCS,
+    LOCK_STATS_GTA,
+    LOCK_STATS_KINDS,
+} lock_stats_kind;
+
+static char const *const g_lock_stats_names[LOCK_STATS_KINDS] = {
+    "naive",
+    "ticket",
+    "mcs",
+    "gta",
+};
+
+typedef struct {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t slow_releases;
+} lock_stats_t;
+
+// Only ever written by the owning thread, atomic so a snapshot can read them
+// while it runs.
+typedef struct {
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t spins;
+    _Atomic uint64_t slow_releases;
+} lock_stats_counters_t;
+
+typedef struct lock_stats_thread lock_stats_thread_t;
+struct lock_stats_thread {
+    lock_stats_counters_t kinds[LOCK_STATS_KINDS];
+    // Spins and contention for the acquire in progress
+    uint64_t pending_spins;
+    bool pending_contended;
+    lock_stats_thread_t *m_next;
+    lock_stats_thread_t *m_prev;
+};
+
+typedef struct {
+    pthread_mutex_t m_mtx;
+    pthread_once_t once;
+    pthread_key_t key;
+    lock_stats_thread_t *threads;
+    // Counters of threads that have exited
+    lock_stats_t retired[LOCK_STATS_KINDS];
+} lock_stats_registry_t;
+
+__attribute__((weak)) lock_stats_registry_t g_lock_stats_registry = {
+    .m_mtx = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+__attribute__((weak)) _Thread_local lock_stats_thread_t *t_lock_stats;
+
+__attribute__((always_inline))
+static inline void
+lock_stats_add(_Atomic uint64_t *const p_counter, uint64_t const n)
+{
+    // Single writer, so no read-modify-write is needed
+    atomic_store_explicit(p_counter, atomic_load_explicit(p_counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void
+lock_stats_read(lock_stats_counters_t const *const p_src, lock_stats_t *const p_dst)
+{
+    p_dst->acquisitions += atomic_load_explicit(&p_src->acquisitions, memory_order_relaxed);
+    p_dst->contended += atomic_load_explicit(&p_src->contended, memory_order_relaxed);
+    p_dst->spins += atomic_load_explicit(&p_src->spins, memory_order_relaxed);
+    p_dst->slow_releases += atomic_load_explicit(&p_src->slow_releases, memory_order_relaxed);
+}
+
+// Fold an exiting thread's counters into the retired totals
+static void
+lock_stats_retire(void *const p)
+{
+    lock_stats_registry_t *const reg = &g_lock_stats_registry;
+    lock_stats_thread_t *const ts = p;
+
+    pthread_mutex_lock(&reg->m_mtx);
+    for (int k = 0; k < LOCK_STATS_KINDS; ++k) {
+        lock_stats_read(&ts->kinds[k], &reg->retired[k]);
+    }
+    if (ts->m_prev != NULL) {
+        ts->m_prev->m_next = ts->m_next;
+    } else {
+        reg->threads = ts->m_next;
+    }
+    if (ts->m_next != NULL) {
+        ts->m_next->m_prev = ts->m_prev;
+    }
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    // This runs on the exiting thread. A lock taken by a later destructor
+    // registers again and is caught by the next destructor pass.
+    t_lock_stats = NULL;
+    free(ts);
+}
+
+static void
+lock_stats_key_init(void)
+{
+    (void)pthread_key_create(&g_lock_stats_registry.key, lock_stats_retire);
+}
+
+__attribute__((noinline))
+static lock_stats_thread_t *
+lock_stats_register(void)
+{
+    lock_stats_registry_t *const reg = &g_lock_stats_registry;
+
+    lock_stats_thread_t *const ts = calloc(1, sizeof(*ts));
+    if (ts == NULL) {
+        fprintf(stderr, "Failed to allocate lock stats\n");
+        abort();
+    }
+
+    pthread_once(&reg->once, lock_stats_key_init);
+    (void)pthread_setspecific(reg->key, ts);
+
+    pthread_mutex_lock(&reg->m_mtx);
+    ts->m_next = reg->threads;
+    if (reg->threads != NULL) {
+        reg->threads->m_prev = ts;
+    }
+    reg->threads = ts;
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    t_lock_stats = ts;
+    return ts;
+}
+
+__attribute__((always_inline))
+static inline lock_stats_thread_t *
+lock_stats_self(void)
+{
+    lock_stats_thread_t *const ts = t_lock_stats;
+    if (__builtin_expect(ts == NULL, 0)) {
+        return lock_stats_register();
+    }
+    return ts;
+}
+
+__attribute__((always_inline))
+static inline void
+lock_stats_spin(void)
+{
+    lock_stats_thread_t *const ts = lock_stats_self();
+    ts->pending_spins++;
+    ts->pending_contended = true;
+}
+
+__attribute__((always_inline))
+static inline void
+lock_stats_contended(void)
+{
+    lock_stats_self()->pending_contended = true;
+}
+
+__attribute__((always_inline))
+static inline void
+lock_stats_acquired(lock_stats_kind const kind)
+{
+    lock_stats_thread_t *const ts = lock_stats_self();
+    lock_stats_counters_t *const c = &ts->kinds[kind];
+    lock_stats_add(&c->acquisitions, 1);
+    if (ts->pending_contended) {
+        lock_stats_add(&c->contended, 1);
+        lock_stats_add(&c->spins, ts->pending_spins);
+        ts->pending_spins = 0;
+        ts->pending_contended = false;
+    }
+}
+
+__attribute__((always_inline))
+static inline void
+lock_stats_slow_release(lock_stats_kind const kind)
+{
+    lock_stats_add(&lock_stats_self()->kinds[kind].slow_releases, 1);
+}
+
+/**
+ * Add up the counters of every thread, live or exited.
+ *
+ * @param p_out Array of LOCK_STATS_KINDS, indexed by lock_stats_kind
+ */
+static inline void
+lock_stats_snapshot(lock_stats_t *const p_out)
+{
+    lock_stats_registry_t *const reg = &g_lock_stats_registry;
+
+    pthread_mutex_lock(&reg->m_mtx);
+    memcpy(p_out, reg->retired, sizeof(reg->retired));
+    for (lock_stats_thread_t const *ts = reg->threads; ts != NULL; ts = ts->m_next) {
+        for (int k = 0; k < LOCK_STATS_KINDS; ++k) {
+            lock_stats_read(&ts->kinds[k], &p_out[k]);
+        }
+    }
+    pthread_mutex_unlock(&reg->m_mtx);
+}
+
+/**
+ * Print the counters that changed between two snapshots.
+ */
+static inline void
+lock_stats_print(FILE *const f, lock_stats_t const *const p_before, lock_stats_t const *const p_after)
+{
+    for (int k = 0; k < LOCK_STATS_KINDS; ++k) {
+        uint64_t const acq = p_after[k].acquisitions - p_before[k].acquisitions;
+        if (acq == 0) {
+            continue;
+        }
+        uint64_t const contended = p_after[k].contended - p_before[k].contended;
+        uint64_t const spins = p_after[k].spins - p_before[k].spins;
+        uint64_t const slow = p_after[k].slow_releases - p_before[k].slow_releases;
+        fprintf(f, "%s: %llu acquisitions, %llu contended (%.1f%%), %.1f spins/contended, %llu slow releases\n",
+                g_lock_stats_names[k], (unsigned long long)acq, (unsigned long long)contended,
+                100.0 * contended / acq, contended != 0 ? (double)spins / contended : 0.0,
+                (unsigned long long)slow);
+    }
+}
+
+#define LOCK_STATS_SPIN() lock_stats_spin()
+#define LOCK_STATS_CONTENDED() lock_stats_contended()
+#define LOCK_STATS_ACQUIRED(kind) lock_stats_acquired(kind)
+#define LOCK_STATS_SLOW_RELEASE(kind) lock_stats_slow_release(kind)
+#else
+#define LOCK_STATS_SPIN() ((void)0)
+#define LOCK_STATS_CONTENDED() ((void)0)
+#define LOCK_STATS_ACQUIRED(kind) ((void)0)
+#define LOCK_STATS_SLOW_RELEASE(kind) ((void)0)
+#endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <assert.h>
@@ -85,6 +86,62 @@ pthread_routine(void *const arg)
     return NULL;
 }
 
+#define NUM_COUPLED_LOCKS 32
+
+// The nodeless API, single threaded: locks released out of order and lock
+// coupling along a chain must not run out of nodes.
+static void
+test_nodeless(void)
+{
+    static mcs_lock_t locks[NUM_COUPLED_LOCKS];
+    for (int i = 0; i < NUM_COUPLED_LOCKS; ++i) {
+        mcs_lock_reset(&locks[i]);
+    }
+
+    for (unsigned round = 0; round < 2 * MCS_NODE_STACK_DEPTH; ++round) {
+        mcs_lock(&locks[0]);
+        mcs_lock(&locks[1]);
+        mcs_lock(&locks[2]);
+        mcs_unlock(&locks[0]);
+        mcs_lock(&locks[3]);
+        mcs_unlock(&locks[2]);
+        mcs_unlock(&locks[3]);
+        mcs_unlock(&locks[1]);
+        assert(t_mcs_nodes.m_depth == 0);
+    }
+
+    mcs_lock(&locks[0]);
+    for (int i = 1; i < NUM_COUPLED_LOCKS; ++i) {
+        mcs_lock(&locks[i]);
+        mcs_unlock(&locks[i - 1]);
+        assert(t_mcs_nodes.m_depth <= 2);
+    }
+    mcs_unlock(&locks[NUM_COUPLED_LOCKS - 1]);
+    assert(t_mcs_nodes.m_depth == 0);
+
+    // mcs_trylock() fills holes the same way
+    bool const got = mcs_trylock(&locks[0]);
+    assert(got);
+    (void)got;
+    for (int i = 1; i < NUM_COUPLED_LOCKS; ++i) {
+        bool const next = mcs_trylock(&locks[i]);
+        assert(next);
+        (void)next;
+        bool const again = mcs_trylock(&locks[i - 1]);
+        assert(!again);
+        (void)again;
+        mcs_unlock(&locks[i - 1]);
+        assert(t_mcs_nodes.m_depth <= 2);
+    }
+    mcs_unlock(&locks[NUM_COUPLED_LOCKS - 1]);
+    assert(t_mcs_nodes.m_depth == 0);
+
+    for (int i = 0; i < NUM_COUPLED_LOCKS; ++i) {
+        assert(atomic_load(&locks[i].m_tail) == NULL);
+    }
+    printf("nodeless mcs_lock ok\n");
+}
+
 int
 main(int argc, char **argv)
 {
@@ -113,6 +170,8 @@ main(int argc, char **argv)
 
     printf("sizeof(mcs_t) = %zu\n", sizeof(mcs_t));
 
+    test_nodeless();
+
     pthread_t *threads = malloc(st->num_threads * sizeof(pthread_t));
     if (threads == NULL) {
         fprintf(stderr, "Failed to allocate threads\n");
@@ -6,6 +6,7 @@
 #include <stddef.h>
 
 #include "backoff.h"
+#include "stats.h"
 
 typedef struct simple_ticket_spinlock tick_t;
 
@@ -31,6 +32,7 @@ ticket_acq(tick_t *const p_lock)
 {
     unsigned const my_ticket = atomic_fetch_add_explicit(&p_lock->next_ticket, 1, memory_order_relaxed);
 
+    backoff_t l_bo = BACKOFF_INIT;
     for (;;) {
         unsigned const now_serving = atomic_load_explicit(&p_lock->now_serving, memory_order_acquire);
         unsigned const diff = my_ticket - now_serving;
@@ -38,14 +40,14 @@ ticket_acq(tick_t *const p_lock)
         if (diff == 0) {
             break;
         } else {
-            for (volatile unsigned i = 0; i < diff; ++i) {
-                backoff();
-            }
+            LOCK_STATS_SPIN();
+            backoff_wait_dist(&l_bo, diff);
 #if defined(__arm__) || defined(__aarch64__)
             wfe();
 #endif
         }
     }
+    LOCK_STATS_ACQUIRED(LOCK_STATS_TICKET);
 }
 
 static inline void
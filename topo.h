@@ -0,0 +1,349 @@
+#pragma once
+
+//
+// CPU topology from /sys/devices/system/cpu
+//
+// For every cpu we can run on this finds its SMT siblings, the cpus it
+// shares a last level cache with, its package and its NUMA node, and can
+// order the cpus by a few placement policies for the benchmarks.
+//
+// Every group is identified by the lowest cpu number in it so the ids are
+// only useful for comparing cpus against each other.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+
+typedef struct {
+    int cpu;
+    int core;       // Lowest cpu sharing this physical core
+    int llc;        // Lowest cpu sharing the last level cache
+    int package;
+    int node;
+    int smt_idx;    // Position of this cpu among its SMT siblings
+    int core_rank;  // Position of the core among the cores sharing the LLC
+    int llc_rank;   // Position of the LLC among the LLCs on the node
+    int pkg_rank;   // Position of the core among the cores in the package
+} topo_cpu_t;
+
+typedef struct {
+    int ncpus;
+    topo_cpu_t *cpus;
+} topo_t;
+
+typedef enum {
+    PLACE_COMPACT,  // One thread per core, packed into as few LLCs/nodes as possible
+    PLACE_SCATTER,  // Spread across nodes, then LLCs, then cores
+    PLACE_SMT,      // Fill both SMT siblings of a core before the next core
+    PLACE_XSOCKET,  // Alternate between packages
+    PLACE_COUNT,
+} placement_t;
+
+static char const *const g_placement_names[PLACE_COUNT] = {
+    "compact",
+    "scatter",
+    "smt",
+    "xsocket",
+};
+
+static inline int
+topo_read_int(char const *const path, int const fallback)
+{
+    FILE *const f = fopen(path, "r");
+    if (f == NULL) {
+        return fallback;
+    }
+    int v = fallback;
+    if (fscanf(f, "%d", &v) != 1) {
+        v = fallback;
+    }
+    fclose(f);
+    return v;
+}
+
+/**
+ * Read a sysfs cpu list ("0-3,8-11") and return the lowest cpu in it.
+ */
+static inline int
+topo_read_list_first(char const *const path, int const fallback)
+{
+    // Lists are sorted so the lowest cpu is the leading number
+    return topo_read_int(path, fallback);
+}
+
+/**
+ * Read a sysfs cpu list and return the position of cpu within it.
+ */
+static inline int
+topo_read_list_index(char const *const path, int const cpu)
+{
+    FILE *const f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char buf[4096];
+    char *const line = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (line == NULL) {
+        return 0;
+    }
+
+    int idx = 0;
+    char *p = line;
+    while (*p != '\0' && *p != '\n') {
+        int const lo = (int)strtol(p, &p, 10);
+        int hi = lo;
+        if (*p == '-') {
+            hi = (int)strtol(p + 1, &p, 10);
+        }
+        if (cpu >= lo && cpu <= hi) {
+            return idx + (cpu - lo);
+        }
+        idx += hi - lo + 1;
+        if (*p == ',') {
+            ++p;
+        } else {
+            break;
+        }
+    }
+    return 0;
+}
+
+static inline int
+topo_find_node(int const cpu)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *const d = opendir(path);
+    if (d == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+            node = (int)strtol(ent->d_name + 4, NULL, 10);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+/**
+ * Find the lowest cpu sharing the highest level cache with cpu.
+ */
+static inline int
+topo_find_llc(int const cpu)
+{
+    int best_level = -1;
+    int llc = cpu;
+    for (int i = 0; ; ++i) {
+        char path[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+        int const level = topo_read_int(path, -1);
+        if (level < 0) {
+            break;
+        }
+        if (level > best_level) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+            best_level = level;
+            llc = topo_read_list_first(path, cpu);
+        }
+    }
+    return llc;
+}
+
+static inline int
+topo_rank(topo_t const *const p_topo, int const idx, int (*const same_group)(topo_cpu_t const *, topo_cpu_t const *),
+        int (*const key)(topo_cpu_t const *))
+{
+    // Count the distinct keys lower than ours within our group
+    topo_cpu_t const *const me = &p_topo->cpus[idx];
+    int rank = 0;
+    for (int i = 0; i < p_topo->ncpus; ++i) {
+        topo_cpu_t const *const other = &p_topo->cpus[i];
+        if (!same_group(me, other) || key(other) >= key(me)) {
+            continue;
+        }
+        // Only count each key once
+        int first = 1;
+        for (int j = 0; j < i; ++j) {
+            if (same_group(me, &p_topo->cpus[j]) && key(&p_topo->cpus[j]) == key(other)) {
+                first = 0;
+                break;
+            }
+        }
+        rank += first;
+    }
+    return rank;
+}
+
+static inline int
+topo_same_llc(topo_cpu_t const *const a, topo_cpu_t const *const b)
+{
+    return a->llc == b->llc;
+}
+
+static inline int
+topo_same_node(topo_cpu_t const *const a, topo_cpu_t const *const b)
+{
+    return a->node == b->node;
+}
+
+static inline int
+topo_same_pkg(topo_cpu_t const *const a, topo_cpu_t const *const b)
+{
+    return a->package == b->package;
+}
+
+static inline int
+topo_core_key(topo_cpu_t const *const a)
+{
+    return a->core;
+}
+
+static inline int
+topo_llc_key(topo_cpu_t const *const a)
+{
+    return a->llc;
+}
+
+/**
+ * Load the topology of every cpu in the process's affinity mask.
+ *
+ * @return 0 on success
+ */
+static inline int
+topo_load(topo_t *const p_topo)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    p_topo->ncpus = 0;
+    p_topo->cpus = calloc(CPU_COUNT(&allowed), sizeof(*p_topo->cpus));
+    if (p_topo->cpus == NULL) {
+        return -1;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        char path[256];
+        topo_cpu_t *const c = &p_topo->cpus[p_topo->ncpus++];
+        c->cpu = cpu;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        c->core = topo_read_list_first(path, cpu);
+        c->smt_idx = topo_read_list_index(path, cpu);
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        c->package = topo_read_int(path, 0);
+
+        c->llc = topo_find_llc(cpu);
+        c->node = topo_find_node(cpu);
+    }
+
+    for (int i = 0; i < p_topo->ncpus; ++i) {
+        topo_cpu_t *const c = &p_topo->cpus[i];
+        c->core_rank = topo_rank(p_topo, i, topo_same_llc, topo_core_key);
+        c->llc_rank = topo_rank(p_topo, i, topo_same_node, topo_llc_key);
+        c->pkg_rank = topo_rank(p_topo, i, topo_same_pkg, topo_core_key);
+    }
+
+    return 0;
+}
+
+static inline void
+topo_free(topo_t *const p_topo)
+{
+    free(p_topo->cpus);
+    p_topo->cpus = NULL;
+    p_topo->ncpus = 0;
+}
+
+static inline topo_cpu_t const *
+topo_get(topo_t const *const p_topo, int const cpu)
+{
+    for (int i = 0; i < p_topo->ncpus; ++i) {
+        if (p_topo->cpus[i].cpu == cpu) {
+            return &p_topo->cpus[i];
+        }
+    }
+    return NULL;
+}
+
+static inline placement_t
+topo_parse_placement(char const *const name)
+{
+    for (int i = 0; i < PLACE_COUNT; ++i) {
+        if (strcmp(name, g_placement_names[i]) == 0) {
+            return (placement_t)i;
+        }
+    }
+    return PLACE_COUNT;
+}
+
+static inline void
+topo_placement_key(topo_cpu_t const *const c, placement_t const policy, int key[5])
+{
+    switch (policy) {
+    case PLACE_COMPACT:
+        key[0] = c->smt_idx; key[1] = c->node; key[2] = c->llc; key[3] = c->core; key[4] = c->cpu;
+        break;
+    case PLACE_SCATTER:
+        key[0] = c->smt_idx; key[1] = c->core_rank; key[2] = c->llc_rank; key[3] = c->node; key[4] = c->cpu;
+        break;
+    case PLACE_SMT:
+        key[0] = c->node; key[1] = c->llc; key[2] = c->core; key[3] = c->smt_idx; key[4] = c->cpu;
+        break;
+    case PLACE_XSOCKET:
+    default:
+        key[0] = c->smt_idx; key[1] = c->pkg_rank; key[2] = c->package; key[3] = c->core; key[4] = c->cpu;
+        break;
+    }
+}
+
+/**
+ * Order the cpus for a placement policy. The first n entries of order are
+ * where n threads should go.
+ *
+ * @param order Must have room for p_topo->ncpus entries
+ */
+static inline void
+topo_order(topo_t const *const p_topo, placement_t const policy, int *const order)
+{
+    // Insertion sort, the cpu count is small and this is done once per sweep
+    for (int i = 0; i < p_topo->ncpus; ++i) {
+        int key[5];
+        topo_placement_key(&p_topo->cpus[i], policy, key);
+
+        int j = i;
+        while (j > 0) {
+            int other[5];
+            topo_placement_key(topo_get(p_topo, order[j - 1]), policy, other);
+            int k = 0;
+            while (k < 5 && other[k] == key[k]) {
+                ++k;
+            }
+            if (k == 5 || other[k] < key[k]) {
+                break;
+            }
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = p_topo->cpus[i].cpu;
+    }
+}
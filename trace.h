@@ -0,0 +1,232 @@
+#pragma once
+
+//
+// Lock trace recording
+//
+// Records when each thread asks for a lock, gets it and releases it so the
+// arrival pattern and critical section lengths of a real workload can be
+// replayed against every lock in the repo (see replay.c).
+//
+// Each thread writes into its own ring buffer so recording is a timestamp
+// and a 16 byte store, with no shared writes. When a buffer fills the oldest
+// events are overwritten. trace_dump() writes every buffer to a file.
+//
+// Wrap the lock calls you care about:
+//
+//     TRACE_REQUEST(lock_id);
+//     mcs_acquire(&lock, &node);
+//     TRACE_ACQUIRED(lock_id);
+//     ...
+//     TRACE_RELEASED(lock_id);
+//     mcs_release(&lock, &node);
+//
+// The macros compile to nothing unless LOCK_TRACE is defined.
+//
+// The registry of buffers is a weak symbol so every translation unit that
+// includes this header shares it.
+//
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cycles.h"
+
+#define TRACE_MAGIC UINT32_C(0x4c4b5452) // "LKTR"
+#define TRACE_VERSION 1u
+
+// Maximum number of threads that can record
+#define TRACE_MAX_THREADS 1024u
+
+typedef enum {
+    TRACE_EV_REQUEST,
+    TRACE_EV_ACQUIRED,
+    TRACE_EV_RELEASED,
+} trace_ev_type;
+
+typedef struct {
+    uint64_t ts;
+    uint32_t lock;
+    uint16_t type;
+    uint16_t reserved;
+} trace_ev_t;
+
+_Static_assert(sizeof(trace_ev_t) == 16, "trace events should be compact");
+
+typedef struct {
+    uint64_t head;      // Total events written, the ring index is head & mask
+    uint64_t mask;
+    trace_ev_t ev[];
+} trace_buf_t;
+
+typedef struct {
+    atomic_bool enabled;
+    uint64_t capacity;  // Events per thread, a power of 2
+    pthread_mutex_t m_mtx;
+    unsigned nbufs;
+    trace_buf_t *bufs[TRACE_MAX_THREADS];
+} trace_registry_t;
+
+// File format, all little endian/native:
+//
+// trace_file_hdr_t
+// for each thread:
+//     trace_thread_hdr_t
+//     trace_ev_t[count] oldest first
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t cycles_per_sec;
+    uint32_t nthreads;
+    uint32_t reserved;
+} trace_file_hdr_t;
+
+typedef struct {
+    uint32_t thread;
+    uint32_t reserved;
+    uint64_t count;
+} trace_thread_hdr_t;
+
+__attribute__((weak)) trace_registry_t g_trace_registry = {
+    .m_mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+__attribute__((weak)) _Thread_local trace_buf_t *t_trace_buf;
+
+/**
+ * Start recording.
+ *
+ * @param capacity Events kept per thread, rounded up to a power of 2
+ */
+static inline void
+trace_start(uint64_t const capacity)
+{
+    uint64_t cap = 1;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    pthread_mutex_lock(&g_trace_registry.m_mtx);
+    if (g_trace_registry.nbufs == 0) {
+        g_trace_registry.capacity = cap;
+    }
+    pthread_mutex_unlock(&g_trace_registry.m_mtx);
+    (void)cycles_per_sec();
+    atomic_store(&g_trace_registry.enabled, true);
+}
+
+static inline void
+trace_stop(void)
+{
+    atomic_store(&g_trace_registry.enabled, false);
+}
+
+__attribute__((noinline))
+static trace_buf_t *
+trace_register(void)
+{
+    trace_registry_t *const reg = &g_trace_registry;
+    trace_buf_t *buf = NULL;
+
+    pthread_mutex_lock(&reg->m_mtx);
+    if (reg->nbufs < TRACE_MAX_THREADS) {
+        buf = calloc(1, sizeof(*buf) + reg->capacity * sizeof(buf->ev[0]));
+        if (buf != NULL) {
+            buf->mask = reg->capacity - 1;
+            reg->bufs[reg->nbufs++] = buf;
+        }
+    }
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    t_trace_buf = buf;
+    return buf;
+}
+
+__attribute__((always_inline))
+static inline void
+trace_record(trace_ev_type const type, uint32_t const lock)
+{
+    if (!atomic_load_explicit(&g_trace_registry.enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_buf_t *buf = t_trace_buf;
+    if (__builtin_expect(buf == NULL, 0)) {
+        buf = trace_register();
+        if (buf == NULL) {
+            return;
+        }
+    }
+    buf->ev[buf->head & buf->mask] = (trace_ev_t) {
+        .ts = cycles_now(),
+        .lock = lock,
+        .type = (uint16_t)type,
+    };
+    buf->head++;
+}
+
+#ifdef LOCK_TRACE
+#define TRACE_REQUEST(lock) trace_record(TRACE_EV_REQUEST, (lock))
+#define TRACE_ACQUIRED(lock) trace_record(TRACE_EV_ACQUIRED, (lock))
+#define TRACE_RELEASED(lock) trace_record(TRACE_EV_RELEASED, (lock))
+#else
+#define TRACE_REQUEST(lock) ((void)0)
+#define TRACE_ACQUIRED(lock) ((void)0)
+#define TRACE_RELEASED(lock) ((void)0)
+#endif
+
+/**
+ * Write every thread's events to a file. Recording should be stopped and
+ * the recording threads quiescent.
+ *
+ * @return 0 on success
+ */
+static inline int
+trace_dump(char const *const path)
+{
+    trace_registry_t *const reg = &g_trace_registry;
+
+    FILE *const f = fopen(path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&reg->m_mtx);
+
+    trace_file_hdr_t const hdr = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .cycles_per_sec = cycles_per_sec(),
+        .nthreads = reg->nbufs,
+    };
+    int status = fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+
+    for (unsigned t = 0; t < reg->nbufs && status == 0; ++t) {
+        trace_buf_t const *const buf = reg->bufs[t];
+        uint64_t const cap = buf->mask + 1;
+        uint64_t const count = buf->head < cap ? buf->head : cap;
+        trace_thread_hdr_t const thdr = {
+            .thread = t,
+            .count = count,
+        };
+        if (fwrite(&thdr, sizeof(thdr), 1, f) != 1) {
+            status = -1;
+            break;
+        }
+        // Oldest first
+        for (uint64_t i = buf->head - count; i < buf->head; ++i) {
+            if (fwrite(&buf->ev[i & buf->mask], sizeof(buf->ev[0]), 1, f) != 1) {
+                status = -1;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&reg->m_mtx);
+
+    if (fclose(f) != 0) {
+        status = -1;
+    }
+    return status;
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+//
+// Critical section workload model for the benchmarks
+//
+// Which lock wins depends a lot on what happens inside and between critical
+// sections. A workload is described by a string of comma separated options:
+//
+//   read=N        cache lines read inside the critical section
+//   write=N       cache lines written inside the critical section
+//   private       the lines belong to the thread instead of being shared by
+//                 everyone, so they don't move with the lock
+//   cs=N          extra cycles spent inside the critical section
+//   think=D       cycles spent between releasing and acquiring again, where
+//                 D is fixed:N, uniform:N (0 to 2N) or exp:N (mean N)
+//   payload=P     also do an operation on a small shared data structure, a
+//                 hash table bucket insert/remove (hash) or a ring buffer
+//                 enqueue/dequeue (queue)
+//
+// e.g. "read=4,write=2,cs=200,think=exp:1000,payload=hash"
+//
+
+#include <math.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backoff.h"
+#include "cycles.h"
+
+#define WL_HASH_BUCKETS 256u
+#define WL_HASH_KEYS 7u
+#define WL_QUEUE_SLOTS 1024u
+
+typedef enum {
+    THINK_NONE,
+    THINK_FIXED,
+    THINK_UNIFORM,
+    THINK_EXP,
+} think_dist;
+
+typedef enum {
+    PAYLOAD_NONE,
+    PAYLOAD_HASH,
+    PAYLOAD_QUEUE,
+} payload_kind;
+
+typedef struct {
+    unsigned read_lines;
+    unsigned write_lines;
+    bool private_lines;
+    uint64_t cs_cycles;
+    think_dist think;
+    uint64_t think_cycles;
+    payload_kind payload;
+} workload_t;
+
+typedef struct {
+    alignas(64) uint64_t v[8];
+} wl_line_t;
+
+typedef struct {
+    alignas(64) uint32_t count;
+    uint32_t pad;
+    uint64_t keys[WL_HASH_KEYS];
+} wl_bucket_t;
+
+typedef struct {
+    alignas(64) uint64_t head;
+    uint64_t tail;
+    alignas(64) uint64_t slots[WL_QUEUE_SLOTS];
+} wl_queue_t;
+
+// Everything the critical sections share
+typedef struct {
+    wl_line_t *lines;
+    wl_bucket_t *buckets;
+    wl_queue_t *queue;
+} workload_data_t;
+
+_Static_assert(sizeof(wl_line_t) == 64, "one cache line");
+_Static_assert(sizeof(wl_bucket_t) == 64, "one cache line");
+
+/**
+ * Parse a workload description.
+ *
+ * @return 0 on success, -1 if spec is malformed
+ */
+static inline int
+workload_parse(workload_t *const w, char const *const spec)
+{
+    *w = (workload_t) { 0 };
+
+    char *const copy = strdup(spec);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    int status = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *const eq = strchr(tok, '=');
+        char const *const val = eq != NULL ? eq + 1 : "";
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+
+        if (strcmp(tok, "read") == 0) {
+            w->read_lines = (unsigned)strtoul(val, NULL, 10);
+        } else if (strcmp(tok, "write") == 0) {
+            w->write_lines = (unsigned)strtoul(val, NULL, 10);
+        } else if (strcmp(tok, "private") == 0) {
+            w->private_lines = true;
+        } else if (strcmp(tok, "shared") == 0) {
+            w->private_lines = false;
+        } else if (strcmp(tok, "cs") == 0) {
+            w->cs_cycles = strtoull(val, NULL, 10);
+        } else if (strcmp(tok, "think") == 0) {
+            char const *const colon = strchr(val, ':');
+            uint64_t const n = colon != NULL ? strtoull(colon + 1, NULL, 10) : 0;
+            size_t const len = colon != NULL ? (size_t)(colon - val) : strlen(val);
+            w->think_cycles = n;
+            if (strncmp(val, "fixed", len) == 0 && len == 5) {
+                w->think = THINK_FIXED;
+            } else if (strncmp(val, "uniform", len) == 0 && len == 7) {
+                w->think = THINK_UNIFORM;
+            } else if (strncmp(val, "exp", len) == 0 && len == 3) {
+                w->think = THINK_EXP;
+            } else if (strncmp(val, "none", len) == 0 && len == 4) {
+                w->think = THINK_NONE;
+            } else {
+                status = -1;
+            }
+        } else if (strcmp(tok, "payload") == 0) {
+            if (strcmp(val, "hash") == 0) {
+                w->payload = PAYLOAD_HASH;
+            } else if (strcmp(val, "queue") == 0) {
+                w->payload = PAYLOAD_QUEUE;
+            } else if (strcmp(val, "none") == 0) {
+                w->payload = PAYLOAD_NONE;
+            } else {
+                status = -1;
+            }
+        } else {
+            status = -1;
+        }
+    }
+
+    free(copy);
+    return status;
+}
+
+/**
+ * Write a description of the workload suitable for a CSV column.
+ */
+static inline void
+workload_describe(workload_t const *const w, char *const buf, size_t const len)
+{
+    static char const *const think_names[] = { "none", "fixed", "uniform", "exp" };
+    static char const *const payload_names[] = { "none", "hash", "queue" };
+    snprintf(buf, len, "read=%u write=%u %s cs=%llu think=%s:%llu payload=%s",
+            w->read_lines, w->write_lines, w->private_lines ? "private" : "shared",
+            (unsigned long long)w->cs_cycles, think_names[w->think],
+            (unsigned long long)w->think_cycles, payload_names[w->payload]);
+}
+
+static inline unsigned
+workload_lines(workload_t const *const w)
+{
+    return w->read_lines > w->write_lines ? w->read_lines : w->write_lines;
+}
+
+static inline wl_line_t *
+workload_alloc_lines(workload_t const *const w)
+{
+    unsigned const n = workload_lines(w);
+    if (n == 0) {
+        return NULL;
+    }
+    wl_line_t *const lines = aligned_alloc(64, n * sizeof(*lines));
+    if (lines != NULL) {
+        memset(lines, 0, n * sizeof(*lines));
+    }
+    return lines;
+}
+
+/**
+ * Allocate the shared data, each structure on its own lines.
+ *
+ * @return 0 on success
+ */
+static inline int
+workload_init(workload_t const *const w, workload_data_t *const data)
+{
+    *data = (workload_data_t) { 0 };
+    if (!w->private_lines) {
+        data->lines = workload_alloc_lines(w);
+        if (workload_lines(w) != 0 && data->lines == NULL) {
+            return -1;
+        }
+    }
+    if (w->payload == PAYLOAD_HASH) {
+        data->buckets = aligned_alloc(64, WL_HASH_BUCKETS * sizeof(*data->buckets));
+        if (data->buckets == NULL) {
+            return -1;
+        }
+        memset(data->buckets, 0, WL_HASH_BUCKETS * sizeof(*data->buckets));
+    } else if (w->payload == PAYLOAD_QUEUE) {
+        data->queue = aligned_alloc(64, sizeof(*data->queue));
+        if (data->queue == NULL) {
+            return -1;
+        }
+        memset(data->queue, 0, sizeof(*data->queue));
+    }
+    return 0;
+}
+
+static inline void
+workload_fini(workload_data_t *const data)
+{
+    free(data->lines);
+    free(data->buckets);
+    free(data->queue);
+    *data = (workload_data_t) { 0 };
+}
+
+__attribute__((always_inline))
+static inline uint64_t
+wl_rand(uint64_t *const rng_state)
+{
+    // xorshift64*
+    uint64_t x = *rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *rng_state = x;
+    return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+__attribute__((always_inline))
+static inline void
+wl_spin(uint64_t const cycles)
+{
+    if (cycles == 0) {
+        return;
+    }
+    uint64_t const start = cycles_now();
+    while (cycles_now() - start < cycles) {
+        backoff();
+    }
+}
+
+/**
+ * Spend the time between releasing the lock and acquiring it again.
+ */
+__attribute__((always_inline))
+static inline void
+workload_think(workload_t const *const w, uint64_t *const rng_state)
+{
+    switch (w->think) {
+    case THINK_FIXED:
+        wl_spin(w->think_cycles);
+        break;
+    case THINK_UNIFORM:
+        wl_spin(wl_rand(rng_state) % (2 * w->think_cycles + 1));
+        break;
+    case THINK_EXP: {
+        // Inverse CDF with u in (0, 1]
+        double const u = ((wl_rand(rng_state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+        wl_spin((uint64_t)(-log(u) * (double)w->think_cycles));
+        break;
+    }
+    case THINK_NONE:
+    default:
+        break;
+    }
+}
+
+_Static_assert(WL_HASH_BUCKETS == 256u, "wl_hash_op takes the top 8 bits of the hash");
+
+static inline void
+wl_hash_op(wl_bucket_t *const buckets, uint64_t const key)
+{
+    // Remove the key if it's there, otherwise insert it
+    wl_bucket_t *const b = &buckets[(key * UINT64_C(0x9E3779B97F4A7C15)) >> 56];
+    for (uint32_t i = 0; i < b->count; ++i) {
+        if (b->keys[i] == key) {
+            b->keys[i] = b->keys[--b->count];
+            return;
+        }
+    }
+    if (b->count < WL_HASH_KEYS) {
+        b->keys[b->count++] = key;
+    }
+}
+
+static inline void
+wl_queue_op(wl_queue_t *const q, uint64_t const r)
+{
+    uint64_t const used = q->tail - q->head;
+    if (((r & 1) != 0 && used < WL_QUEUE_SLOTS) || used == 0) {
+        q->slots[q->tail++ % WL_QUEUE_SLOTS] = r;
+    } else {
+        (void)q->slots[q->head++ % WL_QUEUE_SLOTS];
+    }
+}
+
+/**
+ * The critical section. Must be called with the lock held.
+ *
+ * @param private_lines The calling thread's own lines, used instead of the
+ * shared ones if the workload is private
+ */
+__attribute__((always_inline))
+static inline void
+workload_cs(workload_t const *const w, workload_data_t const *const data, wl_line_t *const private_lines,
+        uint64_t *const rng_state)
+{
+    wl_line_t volatile *const lines = w->private_lines ? private_lines : data->lines;
+
+    for (unsigned i = 0; i < w->read_lines; ++i) {
+        (void)lines[i].v[0];
+    }
+    for (unsigned i = 0; i < w->write_lines; ++i) {
+        lines[i].v[0] = lines[i].v[0] + 1;
+    }
+
+    if (w->payload == PAYLOAD_HASH) {
+        // A small key space so there are removes as well as inserts
+        wl_hash_op(data->buckets, wl_rand(rng_state) & 0x3ff);
+    } else if (w->payload == PAYLOAD_QUEUE) {
+        wl_queue_op(data->queue, wl_rand(rng_state));
+    }
+
+    wl_spin(w->cs_cycles);
+}